@@ -0,0 +1,585 @@
+#include "apu.hpp"
+#include "state.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// --------------------------------- BlipBuffer member functions ---------------------------------
+
+float BlipBuffer::kernel[BlipBuffer::phaseCount][BlipBuffer::kernelWidth];
+
+static bool initKernel(float kernel[BlipBuffer::phaseCount][BlipBuffer::kernelWidth]) {
+	const double pi = 3.14159265358979323846;
+	const double cutoff = 0.45;	// Of the output sample rate
+	const double half = BlipBuffer::kernelWidth / 2;
+
+	for(int p = 0; p < BlipBuffer::phaseCount; p++) {
+		double phase = (double) p / BlipBuffer::phaseCount;
+		double sum = 0;
+		for(int k = 0; k < BlipBuffer::kernelWidth; k++) {
+			double t = k - half - phase;
+			double x = 2 * pi * cutoff * t;
+			double sinc = t == 0 ? 1 : std::sin(x) / x;
+			double window = 0.42 + 0.5 * std::cos(pi * t / half) + 0.08 * std::cos(2 * pi * t / half);	// Blackman
+			kernel[p][k] = (float) (sinc * window);
+			sum += kernel[p][k];
+		}
+		for(int k = 0; k < BlipBuffer::kernelWidth; k++)
+			kernel[p][k] = (float) (kernel[p][k] / sum);
+	}
+	return true;
+}
+
+BlipBuffer::BlipBuffer(int capacity) : bufferCapacity(capacity), samplesPerClock(0), time(0), integrator(0), highPass(0) {
+	static bool kernelReady = initKernel(kernel);
+	(void) kernelReady;
+}
+
+void BlipBuffer::setRate(double rate) { samplesPerClock = rate; }
+
+void BlipBuffer::addDelta(unsigned int clock, float delta) {
+	double position = time + clock * samplesPerClock;
+	int index = (int) position;
+	int phase = (int) ((position - index) * phaseCount);
+	if(index + kernelWidth > (int) buffer.size()) return;
+
+	float* out = &buffer[index];
+	for(int k = 0; k < kernelWidth; k++)
+		out[k] += kernel[phase][k] * delta;
+}
+
+void BlipBuffer::endBlock(unsigned int clocks) { time += clocks * samplesPerClock; }
+
+int BlipBuffer::samplesAvailable() { return (int) time; }
+int BlipBuffer::capacity() { return (int) buffer.size() - kernelWidth; }
+
+int BlipBuffer::readSamples(short* out, int count, int stride) {
+	count = std::min(count, samplesAvailable());
+	for(int i = 0; i < count; i++) {
+		integrator += buffer[i];
+		highPass += (integrator - highPass) * 0.0025f;
+		float sample = (integrator - highPass) * 32767.0f;
+		if(sample > 32767.0f) sample = 32767.0f;
+		else if(sample < -32768.0f) sample = -32768.0f;
+		out[i * stride] = (short) sample;
+	}
+	removeSamples(count);
+	return count;
+}
+
+void BlipBuffer::discardSamples(int count) {
+	count = std::min(count, samplesAvailable());
+	for(int i = 0; i < count; i++) {
+		integrator += buffer[i];
+		highPass += (integrator - highPass) * 0.0025f;
+	}
+	removeSamples(count);
+}
+
+void BlipBuffer::removeSamples(int count) {
+	std::memmove(&buffer[0], &buffer[count], (buffer.size() - count) * sizeof(float));
+	std::fill(buffer.end() - count, buffer.end(), 0.0f);
+	time -= count;
+}
+
+void BlipBuffer::allocate() {
+	buffer.assign(bufferCapacity + kernelWidth, 0.0f);
+}
+
+void BlipBuffer::release() {
+	std::vector<float>().swap(buffer);
+	time = 0;
+}
+
+void BlipBuffer::clear() {
+	std::fill(buffer.begin(), buffer.end(), 0.0f);
+	time = 0;
+	integrator = 0;
+	highPass = 0;
+}
+
+// --------------------------------- APU member functions ---------------------------------------
+
+static const int blipCapacity = 1 << 16;
+static const unsigned int maxBlockClocks = 1 << 15;
+static const float outputScale = 1.0f / (4 * 15 * 8);	// 4 channels, 4 bit level, 3 bit master volume
+
+static const byte dutyTable[4][8] = {
+	{ 0, 0, 0, 0, 0, 0, 0, 1 },	// 12.5%
+	{ 1, 0, 0, 0, 0, 0, 0, 1 },	// 25%
+	{ 1, 0, 0, 0, 0, 1, 1, 1 },	// 50%
+	{ 0, 1, 1, 1, 1, 1, 1, 0 }	// 75%
+};
+
+// Bits that always read back as 1, for 0xFF10 - 0xFF2F
+static const byte readMasks[0x20] = {
+	0x80, 0x3F, 0x00, 0xFF, 0xBF,	// NR10 - NR14
+	0xFF, 0x3F, 0x00, 0xFF, 0xBF,	// NR21 - NR24
+	0x7F, 0xFF, 0x9F, 0xFF, 0xBF,	// NR30 - NR34
+	0xFF, 0xFF, 0x00, 0x00, 0xBF,	// NR41 - NR44
+	0x00, 0x00, 0x70,				// NR50 - NR52
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+APU::APU() : left(blipCapacity), right(blipCapacity) {
+	std::memset(registers, 0, sizeof(registers));
+	powered = true;
+	square1 = SquareChannel();
+	square2 = SquareChannel();
+	wave = WaveChannel();
+	noise = NoiseChannel();
+	noise.lfsr = 0x7FFF;
+
+	frameSequencerStep = 0;
+	clocksToFrameSequencer = 8192;
+
+	clock = nullptr;
+	lastClock = 0;
+	blockTime = 0;
+
+	outputEnabled = false;
+	for(int i = 0; i < 4; i++) outLeft[i] = outRight[i] = 0;
+	rateAdjustment = 1.0;
+	setSampleRate(48000);
+}
+
+APU::~APU() {}
+
+void APU::connectClock(const unsigned long long* masterClock) {
+	clock = masterClock;
+	lastClock = *clock;
+}
+
+void APU::catchUp() {
+	if(clock == nullptr) return;
+	unsigned long long now = *clock;
+
+	while(lastClock < now) {
+		unsigned int chunk = (unsigned int) std::min<unsigned long long>(now - lastClock, clocksToFrameSequencer);
+		chunk = std::min(chunk, maxBlockClocks - blockTime);
+
+		runChannels(blockTime, chunk);
+		blockTime += chunk;
+		lastClock += chunk;
+		clocksToFrameSequencer -= chunk;
+
+		if(clocksToFrameSequencer == 0) {
+			clocksToFrameSequencer = 8192;	// 512 Hz
+			stepFrameSequencer();
+		}
+		if(blockTime >= maxBlockClocks) endBlock();
+	}
+	endBlock();
+}
+
+void APU::endBlock() {
+	if(outputEnabled && blockTime > 0) {
+		left.endBlock(blockTime);
+		right.endBlock(blockTime);
+
+		// Nobody is reading, drop the oldest samples
+		int excess = left.samplesAvailable() - (left.capacity() - 4096);
+		if(excess > 0) {
+			left.discardSamples(excess);
+			right.discardSamples(excess);
+		}
+	}
+	blockTime = 0;
+}
+
+// The channels advance whether or not anyone listens, only the output deltas are skipped
+void APU::runChannels(unsigned int start, unsigned int clocks) {
+	// Square channels
+	SquareChannel* squares[2] = { &square1, &square2 };
+	for(int c = 0; c < 2; c++) {
+		SquareChannel& ch = *squares[c];
+		if(!ch.enabled) continue;
+		unsigned int t = 0;
+		while(ch.timer <= (int) (clocks - t)) {
+			t += ch.timer;
+			ch.timer = (2048 - ch.frequency) * 4;
+			ch.dutyPos = (ch.dutyPos + 1) & 7;
+			if(outputEnabled) updateOutput(c, start + t);
+		}
+		ch.timer -= clocks - t;
+	}
+
+	// Wave channel
+	if(wave.enabled) {
+		unsigned int t = 0;
+		while(wave.timer <= (int) (clocks - t)) {
+			t += wave.timer;
+			wave.timer = (2048 - wave.frequency) * 2;
+			wave.position = (wave.position + 1) & 31;
+			if(outputEnabled) updateOutput(2, start + t);
+		}
+		wave.timer -= clocks - t;
+	}
+
+	// Noise channel; shifts 14 and 15 don't clock the LFSR
+	if(noise.enabled && noise.clockShift < 14) {
+		unsigned int t = 0;
+		while(noise.timer <= (int) (clocks - t)) {
+			t += noise.timer;
+			noise.timer = noisePeriod();
+			word feedback = (noise.lfsr ^ (noise.lfsr >> 1)) & 1;
+			noise.lfsr = (noise.lfsr >> 1) | (feedback << 14);
+			if(noise.widthMode) noise.lfsr = (noise.lfsr & ~0x40) | (feedback << 6);
+			if(outputEnabled) updateOutput(3, start + t);
+		}
+		noise.timer -= clocks - t;
+	}
+}
+
+void APU::stepFrameSequencer() {
+	if(frameSequencerStep % 2 == 0) {
+		clockLength(square1.length, square1.lengthEnable, square1.enabled);
+		clockLength(square2.length, square2.lengthEnable, square2.enabled);
+		clockLength(wave.length, wave.lengthEnable, wave.enabled);
+		clockLength(noise.length, noise.lengthEnable, noise.enabled);
+	}
+	if(frameSequencerStep == 2 || frameSequencerStep == 6) clockSweep();
+	if(frameSequencerStep == 7) {
+		clockEnvelope(square1.envelope);
+		clockEnvelope(square2.envelope);
+		clockEnvelope(noise.envelope);
+	}
+	frameSequencerStep = (frameSequencerStep + 1) & 7;
+	updateOutputs();
+}
+
+void APU::clockLength(int& length, bool lengthEnable, bool& enabled) {
+	if(lengthEnable && length > 0) {
+		length--;
+		if(length == 0) enabled = false;
+	}
+}
+
+void APU::clockEnvelope(Envelope& envelope) {
+	if(envelope.period == 0) return;
+	if(envelope.timer > 0) envelope.timer--;
+	if(envelope.timer == 0) {
+		envelope.timer = envelope.period;
+		if(envelope.increase && envelope.volume < 15) envelope.volume++;
+		else if(!envelope.increase && envelope.volume > 0) envelope.volume--;
+	}
+}
+
+void APU::clockSweep() {
+	if(square1.sweepTimer > 0) square1.sweepTimer--;
+	if(square1.sweepTimer != 0) return;
+
+	square1.sweepTimer = square1.sweepPeriod != 0 ? square1.sweepPeriod : 8;
+	if(!square1.sweepEnabled || square1.sweepPeriod == 0) return;
+
+	word frequency = sweepFrequency();
+	if(frequency <= 2047 && square1.sweepShift != 0) {
+		square1.shadowFrequency = frequency;
+		square1.frequency = frequency;
+		sweepFrequency();	// Overflow check with the new frequency
+	}
+}
+
+word APU::sweepFrequency() {
+	word delta = square1.shadowFrequency >> square1.sweepShift;
+	word frequency = square1.sweepNegate ? square1.shadowFrequency - delta : square1.shadowFrequency + delta;
+	if(frequency > 2047) square1.enabled = false;
+	return frequency;
+}
+
+int APU::noisePeriod() {
+	int base = noise.divisor == 0 ? 8 : noise.divisor * 16;
+	return base << noise.clockShift;
+}
+
+int APU::channelLevel(int channel) {
+	switch(channel) {
+		case 0:
+			return square1.enabled ? dutyTable[square1.duty][square1.dutyPos] * square1.envelope.volume : 0;
+		case 1:
+			return square2.enabled ? dutyTable[square2.duty][square2.dutyPos] * square2.envelope.volume : 0;
+		case 2: {
+			if(!wave.enabled || wave.volumeCode == 0) return 0;
+			byte sample = registers[0x20 + wave.position / 2];
+			sample = (wave.position & 1) != 0 ? sample & 0x0F : sample >> 4;
+			return sample >> (wave.volumeCode - 1);
+		}
+		case 3:
+			return noise.enabled ? (~noise.lfsr & 1) * noise.envelope.volume : 0;
+	}
+	return 0;
+}
+
+void APU::updateOutput(int channel, unsigned int time) {
+	if(!outputEnabled) return;
+	int level = channelLevel(channel);
+	byte volume = registers[0x14];	// NR50
+	byte panning = registers[0x15];	// NR51
+
+	int l = (panning >> (4 + channel) & 1) != 0 ? level * (((volume >> 4) & 0x07) + 1) : 0;
+	int r = (panning >> channel & 1) != 0 ? level * ((volume & 0x07) + 1) : 0;
+	if(l != outLeft[channel]) {
+		left.addDelta(time, (l - outLeft[channel]) * outputScale);
+		outLeft[channel] = l;
+	}
+	if(r != outRight[channel]) {
+		right.addDelta(time, (r - outRight[channel]) * outputScale);
+		outRight[channel] = r;
+	}
+}
+
+void APU::updateOutputs() {
+	for(int i = 0; i < 4; i++) updateOutput(i, blockTime);
+}
+
+void APU::setEnvelope(Envelope& envelope, byte data) {
+	envelope.initialVolume = data >> 4;
+	envelope.increase = (data & 0x08) != 0;
+	envelope.period = data & 0x07;
+}
+
+void APU::triggerSquare(SquareChannel& ch, bool sweep) {
+	ch.enabled = ch.envelope.initialVolume != 0 || ch.envelope.increase;	// DAC on
+	if(ch.length == 0) ch.length = 64;
+	ch.timer = (2048 - ch.frequency) * 4;
+	ch.envelope.volume = ch.envelope.initialVolume;
+	ch.envelope.timer = ch.envelope.period;
+
+	if(sweep) {
+		ch.shadowFrequency = ch.frequency;
+		ch.sweepTimer = ch.sweepPeriod != 0 ? ch.sweepPeriod : 8;
+		ch.sweepEnabled = ch.sweepPeriod != 0 || ch.sweepShift != 0;
+		if(ch.sweepShift != 0) sweepFrequency();
+	}
+}
+
+void APU::triggerWave() {
+	wave.enabled = wave.dacOn;
+	if(wave.length == 0) wave.length = 256;
+	wave.timer = (2048 - wave.frequency) * 2;
+	wave.position = 0;
+}
+
+void APU::triggerNoise() {
+	noise.enabled = noise.envelope.initialVolume != 0 || noise.envelope.increase;	// DAC on
+	if(noise.length == 0) noise.length = 64;
+	noise.timer = noisePeriod();
+	noise.lfsr = 0x7FFF;
+	noise.envelope.volume = noise.envelope.initialVolume;
+	noise.envelope.timer = noise.envelope.period;
+}
+
+void APU::powerOff() {
+	std::memset(registers, 0, 0x20);
+	square1 = SquareChannel();
+	square2 = SquareChannel();
+	wave = WaveChannel();
+	noise = NoiseChannel();
+	noise.lfsr = 0x7FFF;
+	powered = false;
+	updateOutputs();
+}
+
+void APU::setOutputEnabled(bool enable) {
+	catchUp();
+	if(enable && !outputEnabled) {
+		left.allocate();
+		right.allocate();
+		left.clear();
+		right.clear();
+		for(int i = 0; i < 4; i++) outLeft[i] = outRight[i] = 0;
+		outputEnabled = true;
+		updateOutputs();
+	} else if(!enable) {
+		left.release();
+		right.release();
+		outputEnabled = false;
+	}
+}
+
+void APU::setSampleRate(int rate) {
+	catchUp();
+	sampleRate = rate;
+	updateRate();
+}
+
+int APU::getSampleRate() { return sampleRate; }
+
+void APU::setRateAdjustment(double ratio) {
+	catchUp();
+	rateAdjustment = ratio;
+	updateRate();
+}
+
+void APU::updateRate() {
+	double samplesPerClock = sampleRate * rateAdjustment / clockRate;
+	left.setRate(samplesPerClock);
+	right.setRate(samplesPerClock);
+}
+
+int APU::readSamples(short* out, int count) {
+	catchUp();
+	count = std::min(count, std::min(left.samplesAvailable(), right.samplesAvailable()));
+	left.readSamples(out, count, 2);
+	right.readSamples(out + 1, count, 2);
+	return count;
+}
+
+int APU::samplesAvailable() {
+	catchUp();
+	return std::min(left.samplesAvailable(), right.samplesAvailable());
+}
+
+byte APU::getByte(word addr) {
+	int index = addr - 0xFF10;
+	if(index == 0x16) {	// NR52
+		byte status = powered ? 0xF0 : 0x70;
+		if(square1.enabled) status |= 0x01;
+		if(square2.enabled) status |= 0x02;
+		if(wave.enabled) status |= 0x04;
+		if(noise.enabled) status |= 0x08;
+		return status;
+	}
+	if(index >= 0x20) return registers[index];	// Wave RAM
+	return registers[index] | readMasks[index];
+}
+
+void APU::setByte(word addr, byte data) {
+	int index = addr - 0xFF10;
+	if(index >= 0x20) {	// Wave RAM
+		registers[index] = data;
+		return;
+	}
+	if(index == 0x16) {	// NR52
+		bool power = (data & 0x80) != 0;
+		if(!power && powered) powerOff();
+		else if(power && !powered) {
+			powered = true;
+			frameSequencerStep = 0;
+		}
+		return;
+	}
+	if(!powered) return;
+	registers[index] = data;
+
+	switch(index) {
+		case 0x00: // NR10
+			square1.sweepPeriod = (data >> 4) & 0x07;
+			square1.sweepNegate = (data & 0x08) != 0;
+			square1.sweepShift = data & 0x07;
+			break;
+		case 0x01: // NR11
+			square1.duty = data >> 6;
+			square1.length = 64 - (data & 0x3F);
+			break;
+		case 0x02: // NR12
+			setEnvelope(square1.envelope, data);
+			if((data & 0xF8) == 0) square1.enabled = false;	// DAC off
+			break;
+		case 0x03: // NR13
+			square1.frequency = (square1.frequency & 0x700) | data;
+			break;
+		case 0x04: // NR14
+			square1.frequency = (square1.frequency & 0xFF) | ((data & 0x07) << 8);
+			square1.lengthEnable = (data & 0x40) != 0;
+			if((data & 0x80) != 0) triggerSquare(square1, true);
+			break;
+		case 0x06: // NR21
+			square2.duty = data >> 6;
+			square2.length = 64 - (data & 0x3F);
+			break;
+		case 0x07: // NR22
+			setEnvelope(square2.envelope, data);
+			if((data & 0xF8) == 0) square2.enabled = false;
+			break;
+		case 0x08: // NR23
+			square2.frequency = (square2.frequency & 0x700) | data;
+			break;
+		case 0x09: // NR24
+			square2.frequency = (square2.frequency & 0xFF) | ((data & 0x07) << 8);
+			square2.lengthEnable = (data & 0x40) != 0;
+			if((data & 0x80) != 0) triggerSquare(square2, false);
+			break;
+		case 0x0A: // NR30
+			wave.dacOn = (data & 0x80) != 0;
+			if(!wave.dacOn) wave.enabled = false;
+			break;
+		case 0x0B: // NR31
+			wave.length = 256 - data;
+			break;
+		case 0x0C: // NR32
+			wave.volumeCode = (data >> 5) & 0x03;
+			break;
+		case 0x0D: // NR33
+			wave.frequency = (wave.frequency & 0x700) | data;
+			break;
+		case 0x0E: // NR34
+			wave.frequency = (wave.frequency & 0xFF) | ((data & 0x07) << 8);
+			wave.lengthEnable = (data & 0x40) != 0;
+			if((data & 0x80) != 0) triggerWave();
+			break;
+		case 0x10: // NR41
+			noise.length = 64 - (data & 0x3F);
+			break;
+		case 0x11: // NR42
+			setEnvelope(noise.envelope, data);
+			if((data & 0xF8) == 0) noise.enabled = false;
+			break;
+		case 0x12: // NR43
+			noise.clockShift = data >> 4;
+			noise.widthMode = (data & 0x08) != 0;
+			noise.divisor = data & 0x07;
+			break;
+		case 0x13: // NR44
+			noise.lengthEnable = (data & 0x40) != 0;
+			if((data & 0x80) != 0) triggerNoise();
+			break;
+	}
+	updateOutputs();
+}
+
+byte APU::readByte(word addr) {
+	catchUp();
+	return getByte(addr);
+}
+
+void APU::writeByte(word addr, byte data) {
+	catchUp();
+	setByte(addr, data);
+}
+
+// Field by field, so struct padding never ends up in a state and equal machines give equal states
+template<typename F>
+void APU::visitState(F f) {
+	f(registers);
+	f(powered);
+	SquareChannel* squares[2] = { &square1, &square2 };
+	for(SquareChannel* sq : squares) {
+		f(sq->enabled); f(sq->duty); f(sq->dutyPos); f(sq->frequency); f(sq->timer); f(sq->length); f(sq->lengthEnable);
+		f(sq->envelope.initialVolume); f(sq->envelope.increase); f(sq->envelope.period); f(sq->envelope.volume); f(sq->envelope.timer);
+		f(sq->sweepPeriod); f(sq->sweepNegate); f(sq->sweepShift); f(sq->sweepTimer); f(sq->shadowFrequency); f(sq->sweepEnabled);
+	}
+	f(wave.enabled); f(wave.dacOn); f(wave.frequency); f(wave.timer); f(wave.position); f(wave.volumeCode); f(wave.length); f(wave.lengthEnable);
+	f(noise.enabled); f(noise.lfsr); f(noise.clockShift); f(noise.widthMode); f(noise.divisor); f(noise.timer); f(noise.length); f(noise.lengthEnable);
+	f(noise.envelope.initialVolume); f(noise.envelope.increase); f(noise.envelope.period); f(noise.envelope.volume); f(noise.envelope.timer);
+	f(frameSequencerStep);
+	f(clocksToFrameSequencer);
+}
+
+void APU::saveState(std::ostream& out) {
+	catchUp();
+	visitState([&out](auto& value) { writeState(out, value); });
+}
+
+void APU::loadState(std::istream& in) {
+	visitState([&in](auto& value) { readState(in, value); });
+
+	// Restart the output from silence at the restored clock
+	lastClock = clock != nullptr ? *clock : 0;
+	blockTime = 0;
+	left.clear();
+	right.clear();
+	for(int i = 0; i < 4; i++) outLeft[i] = outRight[i] = 0;
+	updateOutputs();
+}
@@ -0,0 +1,169 @@
+#ifndef APU_HPP
+#define APU_HPP
+
+#include "defs.hpp"
+#include <iostream>
+#include <vector>
+
+// Band-limited step synthesis: amplitude changes are added as deltas at their exact
+// clock and smeared over a few samples with a windowed sinc, then integrated on read.
+class BlipBuffer {
+public:
+	static const int kernelWidth = 16;
+	static const int phaseCount = 32;
+private:
+	static float kernel[phaseCount][kernelWidth];	// Filled by the first constructor
+
+	std::vector<float> buffer;		// Only allocated while the output is used
+	int bufferCapacity;
+	double samplesPerClock;
+	double time;		// Position of clock 0 of the current block in samples
+	float integrator;
+	float highPass;		// DC blocker state
+
+	void removeSamples(int count);
+public:
+	BlipBuffer(int capacity);
+
+	void setRate(double samplesPerClock);
+	void addDelta(unsigned int clock, float delta);
+	void endBlock(unsigned int clocks);
+
+	int samplesAvailable();
+	int capacity();
+	int readSamples(short* out, int count, int stride);
+	void discardSamples(int count);
+	void clear();
+	void allocate();
+	void release();
+};
+
+class APU {
+private:
+	struct Envelope {
+		byte initialVolume;
+		bool increase;
+		byte period;
+		byte volume;
+		byte timer;
+	};
+
+	struct SquareChannel {
+		bool enabled;
+		byte duty;
+		byte dutyPos;
+		word frequency;
+		int timer;
+		int length;
+		bool lengthEnable;
+		Envelope envelope;
+
+		// Channel 1 only
+		byte sweepPeriod;
+		bool sweepNegate;
+		byte sweepShift;
+		byte sweepTimer;
+		word shadowFrequency;
+		bool sweepEnabled;
+	};
+
+	struct WaveChannel {
+		bool enabled;
+		bool dacOn;
+		word frequency;
+		int timer;
+		byte position;
+		byte volumeCode;
+		int length;
+		bool lengthEnable;
+	};
+
+	struct NoiseChannel {
+		bool enabled;
+		word lfsr;
+		byte clockShift;
+		bool widthMode;
+		byte divisor;
+		int timer;
+		int length;
+		bool lengthEnable;
+		Envelope envelope;
+	};
+
+	byte registers[0x30];	// 0xFF10 - 0xFF3F as written, wave RAM at 0x20
+	bool powered;
+
+	SquareChannel square1;
+	SquareChannel square2;
+	WaveChannel wave;
+	NoiseChannel noise;
+
+	byte frameSequencerStep;
+	int clocksToFrameSequencer;
+
+	// Lazy clocking against the master clock
+	const unsigned long long* clock;
+	unsigned long long lastClock;
+	unsigned int blockTime;
+
+	// Output
+	bool outputEnabled;
+	int sampleRate;
+	double rateAdjustment;	// Resampling ratio set by dynamic rate control
+	BlipBuffer left;
+	BlipBuffer right;
+	int outLeft[4];
+	int outRight[4];
+
+	void updateRate();
+	void runChannels(unsigned int start, unsigned int clocks);
+	void stepFrameSequencer();
+	void endBlock();
+
+	int channelLevel(int);
+	void updateOutput(int, unsigned int time);
+	void updateOutputs();
+
+	void triggerSquare(SquareChannel&, bool sweep);
+	void triggerWave();
+	void triggerNoise();
+	void clockLength(int& length, bool lengthEnable, bool& enabled);
+	void clockEnvelope(Envelope&);
+	void clockSweep();
+	word sweepFrequency();
+	void setEnvelope(Envelope&, byte data);
+	int noisePeriod();
+	void powerOff();
+
+	template<typename F> void visitState(F);
+public:
+	static const int clockRate = 4194304;
+
+	APU();
+	~APU();
+
+	void connectClock(const unsigned long long*);
+
+	// Synthesizes everything up to the current master clock
+	void catchUp();
+
+	// Audio is only synthesized while enabled; the channel state advances regardless
+	void setOutputEnabled(bool);
+	void setSampleRate(int);
+	int getSampleRate();
+	void setRateAdjustment(double);
+
+	// Reads up to count interleaved stereo frames, returns the number read
+	int readSamples(short* out, int count);
+	int samplesAvailable();
+
+	byte getByte(word);
+	void setByte(word, byte);
+	byte readByte(word);
+	void writeByte(word, byte);
+
+	void saveState(std::ostream&);
+	void loadState(std::istream&);
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "audio.hpp"
+#include "state.hpp"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// --------------------------------- SDLAudioSink member functions -------------------------------
+
+SDLAudioSink::SDLAudioSink(int sampleRate) : device(0), sampleRate(sampleRate), started(false), underruns(0) {
+	if(SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+		std::cout << "Couldn't init SDL audio: " << SDL_GetError() << std::endl;
+		return;
+	}
+
+	SDL_AudioSpec want = {}, have = {};
+	want.freq = sampleRate;
+	want.format = AUDIO_S16SYS;
+	want.channels = 2;
+	want.samples = 1024;
+	want.callback = NULL;	// Queue mode
+	device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+	if(device == 0) {
+		std::cout << "Couldn't open audio device: " << SDL_GetError() << std::endl;
+		return;
+	}
+	SDL_PauseAudioDevice(device, 0);
+}
+
+SDLAudioSink::~SDLAudioSink() {
+	if(device != 0) SDL_CloseAudioDevice(device);
+	SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
+
+bool SDLAudioSink::isOpen() { return device != 0; }
+int SDLAudioSink::getSampleRate() { return sampleRate; }
+
+void SDLAudioSink::write(const short* samples, int frames) {
+	if(device == 0) return;
+	if(started && SDL_GetQueuedAudioSize(device) == 0) underruns++;	// The device ran dry
+	SDL_QueueAudio(device, samples, frames * 2 * sizeof(short));
+	started = true;
+}
+
+int SDLAudioSink::getQueuedFrames() { return device != 0 ? SDL_GetQueuedAudioSize(device) / (2 * sizeof(short)) : 0; }
+unsigned long long SDLAudioSink::getUnderruns() { return underruns; }
+
+// --------------------------------- AudioSync member functions ----------------------------------
+
+AudioSync::AudioSync(SDLAudioSink* sink, int targetLatencyMs) : 
+	sink(sink), targetFrames(sink->getSampleRate() * targetLatencyMs / 1000), maxDeviation(0.005), fill(0), adjustment(0) {
+	fill = targetFrames;
+}
+
+double AudioSync::update() {
+	fill = fill * 0.9 + sink->getQueuedFrames() * 0.1;
+
+	// Produce fewer samples when the queue is above target, more when below
+	double error = (fill - targetFrames) / targetFrames;
+	error = std::max(-1.0, std::min(1.0, error));
+	adjustment = -maxDeviation * error;
+	return 1.0 + adjustment;
+}
+
+void AudioSync::wait() {
+	int excess = sink->getQueuedFrames() - targetFrames;
+	while(excess > 0) {
+		// Sleep for the time the device needs to play the excess
+		std::this_thread::sleep_for(std::chrono::microseconds(1000000LL * excess / sink->getSampleRate()));
+		excess = sink->getQueuedFrames() - targetFrames;
+	}
+}
+
+AudioSync::Stats AudioSync::getStats() {
+	Stats stats;
+	stats.latency = 1000.0 * sink->getQueuedFrames() / sink->getSampleRate();
+	stats.targetLatency = 1000.0 * targetFrames / sink->getSampleRate();
+	stats.adjustment = adjustment;
+	stats.underruns = sink->getUnderruns();
+	return stats;
+}
+
+// --------------------------------- WavAudioSink member functions -------------------------------
+
+WavAudioSink::WavAudioSink(std::string filepath, int sampleRate) : file(filepath, std::ios::binary), dataSize(0), sampleRate(sampleRate) {
+	if(!file) std::cerr << "Couldn't write WAV file: " << filepath << std::endl;
+	else writeHeader();
+}
+
+WavAudioSink::~WavAudioSink() {
+	if(!file) return;
+	// Patch the sizes now that they are known
+	file.seekp(0, std::ios::beg);
+	writeHeader();
+}
+
+bool WavAudioSink::isOpen() { return (bool) file; }
+
+void WavAudioSink::writeHeader() {
+	unsigned int riffSize = 36 + dataSize;
+	unsigned int formatSize = 16;
+	unsigned short format = 1;	// PCM
+	unsigned short channels = 2;
+	unsigned int rate = sampleRate;
+	unsigned int byteRate = sampleRate * 4;
+	unsigned short blockAlign = 4;
+	unsigned short bitsPerSample = 16;
+
+	file.write("RIFF", 4);
+	writeState(file, riffSize);
+	file.write("WAVEfmt ", 8);
+	writeState(file, formatSize);
+	writeState(file, format);
+	writeState(file, channels);
+	writeState(file, rate);
+	writeState(file, byteRate);
+	writeState(file, blockAlign);
+	writeState(file, bitsPerSample);
+	file.write("data", 4);
+	writeState(file, dataSize);
+}
+
+void WavAudioSink::write(const short* samples, int frames) {
+	if(!file) return;
+	file.write((const char*) samples, frames * 2 * sizeof(short));
+	dataSize += frames * 2 * sizeof(short);
+}
@@ -0,0 +1,82 @@
+#ifndef AUDIO_HPP
+#define AUDIO_HPP
+
+#include "SDL.h"
+#include <fstream>
+#include <string>
+
+// Receives interleaved 16 bit stereo samples from the APU
+class AudioSink {
+public:
+	virtual ~AudioSink() {}
+	virtual void write(const short* samples, int frames) = 0;
+};
+
+// Plays through an SDL audio queue
+class SDLAudioSink : public AudioSink {
+private:
+	SDL_AudioDeviceID device;
+	int sampleRate;
+	bool started;
+	unsigned long long underruns;
+public:
+	SDLAudioSink(int sampleRate);
+	SDLAudioSink(const SDLAudioSink&) = delete;
+	~SDLAudioSink();
+
+	bool isOpen();
+	int getSampleRate();
+	void write(const short* samples, int frames);
+
+	int getQueuedFrames();
+	unsigned long long getUnderruns();
+};
+
+// Audio driven synchronization: the emulation waits on the audio queue instead of a
+// frame timer, and dynamic rate control resamples by up to +-0.5% to hold the queue
+// near the target latency.
+class AudioSync {
+public:
+	struct Stats {
+		double latency;				// Queued audio in ms
+		double targetLatency;		// In ms
+		double adjustment;			// Current resampling ratio - 1
+		unsigned long long underruns;
+	};
+
+private:
+	SDLAudioSink* sink;
+	int targetFrames;
+	double maxDeviation;
+	double fill;			// Smoothed queue fill in frames
+	double adjustment;
+public:
+	AudioSync(SDLAudioSink* sink, int targetLatencyMs);
+
+	// Resampling ratio for the next frame
+	double update();
+
+	// Sleeps until the queue has drained to the target latency
+	void wait();
+
+	Stats getStats();
+};
+
+// Writes a 16 bit stereo PCM WAV file, for headless runs
+class WavAudioSink : public AudioSink {
+private:
+	std::ofstream file;
+	unsigned int dataSize;
+	int sampleRate;
+
+	void writeHeader();
+public:
+	WavAudioSink(std::string filepath, int sampleRate);
+	WavAudioSink(const WavAudioSink&) = delete;
+	~WavAudioSink();
+
+	bool isOpen();
+	void write(const short* samples, int frames);
+};
+
+#endif
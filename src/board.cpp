@@ -1,80 +1,134 @@
 #include "board.hpp"
+#include "state.hpp"
+#include <new>
+
+static const unsigned int stateMagic = 0x54534247;	// "GBST"
+static const unsigned int stateVersion = 9;
 
 Board::Board(std::string filepath) {
 	try {
-		memory = new Memory(filepath);
+		memory = new (memoryStorage) Memory(filepath);
 	} catch(const std::exception& e) {
 		std::cerr << e.what() << std::endl;
 	}
 	if(memory != nullptr) {
-		memory->connectLCD(&lcd);
-		cpu.connectMemory(memory);
+		connect();
 		cpu.init();
 	}
 }
 
-Board::~Board() {
-	if(memory != nullptr) delete memory;
+Board::Board(Board* parent) : cpu(parent->cpu), timer(parent->timer), interrupts(parent->interrupts), serial(parent->serial), lcd(parent->lcd) {
+	memory = parent->memory->fork(memoryStorage);
+	lcd.setObserver(nullptr);
+	connect();
 }
 
-void Board::run() {
-	bool flag = false;
-	unsigned int addressToStop = 0x28A0000;
-	long long totalClocks = 0;
-	for(long long count = 0;; count++) {
-		cpu.handleInterrupts();
-		byte opcode = memory->readByte(cpu.regs.pc);
-		if(flag || cpu.regs.pc == addressToStop) { // 0x028A confirmed // LCDC BG gets turned off after this
-			flag = true;
-			std::cout << std::hex << std::uppercase << "Executing opcode: 0x" << +opcode << " at address 0x" << cpu.regs.pc << std::nouppercase << std::dec << std::endl;
-			byte b = memory->readByte(0xFF44);
-			std::cout << std::hex << std::uppercase << "REG AF: 0x" << (int)cpu.regs.af << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "REG BC: 0x" << (int)cpu.regs.bc << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "REG DE: 0x" << (int)cpu.regs.de << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "REG HL: 0x" << (int)cpu.regs.hl << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "REG SP: 0x" << (int)cpu.regs.sp << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "TOP STACK WORD: 0x" << memory->readWord(cpu.regs.sp) << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "LCDC: 0x" << (int)lcd.LCDCreg << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "STAT: 0x" << (int)lcd.STATreg << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "LY: 0x" << (int)lcd.LYreg << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "IE: 0x" << (int) memory->readByte(IE) << std::nouppercase << std::dec << std::endl;
-			std::cout << std::hex << std::uppercase << "IF: 0x" << (int) memory->readByte(0xFF0F) << std::nouppercase << std::dec << std::endl;
-
-			
-			std::string line;
-			std::getline(std::cin, line);
-			if(!line.empty()) {
-				std::stringstream streamedLine(line);
-				streamedLine >> std::hex >> addressToStop;
-				flag = false;
-			}
-			std::cout << std::hex << std::uppercase << "Stopping address: 0x" << addressToStop << std::nouppercase << std::dec << std::endl << std::endl;
-
-		}
-		totalClocks += cpu.clocks;
-		cpu.clocks = 0;
-		cpu.exec(opcode);
-		lcd.run(cpu.clocks);
-	}
+// Points the parts at each other and at this board's interrupt controller
+void Board::connect() {
+	memory->connectLCD(&lcd);
+	memory->connectTimer(&timer);
+	memory->connectSerial(&serial);
+	memory->connectInterrupts(&interrupts);
+	lcd.connectInterrupts(&interrupts);
+	timer.connectInterrupts(&interrupts);
+	serial.connectClock(&memory->clockCounter);
+	serial.connectInterrupts(&interrupts);
+	cpu.connectMemory(memory);
+	cpu.connectInterrupts(&interrupts);
+}
+
+Board::~Board() {
+	serial.connectLink(nullptr);
+	serial.connectPeer(nullptr);
+	if(memory != nullptr) memory->~Memory();
 }
 
 void Board::step() {
 	cpu.handleInterrupts();
+	execute();
+}
+
+void Board::execute() {
 	byte opcode = memory->readByte(cpu.regs.pc);
 	cpu.clocks = 0;
 	cpu.exec(opcode);
+	memory->clockCounter += cpu.clocks;
 	lcd.run(cpu.clocks);
-	memory->runTimer(cpu.clocks);
-	
-	// Check for timer interupt
-	if(memory->isTimerInterruptRequested()) {
-		memory->setByte(0xFF0F, memory->getByte(0xFF0F) | 1 << 2);
-		memory->setTimerInterruptRequested(false);
+	timer.run(cpu.clocks);
+	if(memory->clockCounter >= serial.nextEvent) serial.update();
+}
+
+void Board::connectSerial(SerialPort* port) { serial.connectLink(port); }
+
+void Board::connectSerialPeer(Board* peer) { serial.connectPeer(peer != nullptr ? &peer->serial : nullptr); }
+
+// The LCD completes no frame while it is off, nor while a game keeps turning it back on
+// before it gets to the end of one. A frame started up to a frame after turning it on
+// completes well within three frames of clocks.
+bool Board::isFrameOverdue(unsigned long long frameEnd) {
+	return (lcd.LCDCreg & 0x80) == 0 || memory->clockCounter >= frameEnd + 2 * clocksPerFrame;
+}
+
+void Board::runFrame() {
+	lcd.screenRedrawn = false;
+	memory->latchJoypad();
+	unsigned long long frameEnd = memory->clockCounter + clocksPerFrame;
+	while(!lcd.screenRedrawn) {
+		step();
+		if(memory->clockCounter >= frameEnd && isFrameOverdue(frameEnd)) lcd.completeFrame();
+	}
+
+	if(audioSink != nullptr) {
+		short samples[2 * 1024];
+		int count;
+		while((count = memory->getApu().readSamples(samples, 1024)) > 0)
+			audioSink->write(samples, count);
 	}
 
-	// Check for joypad interupt
-	if(memory->isJoypadInterruptRequested()) {
-		memory->setByte(0xFF0F, memory->getByte(0xFF0F) | 1 << 4);
-		memory->setJoypadInterruptRequested(false);
+	memory->flushSave(false);	// Cheap unless the cart RAM was written
+}
+
+void Board::setAudioSink(AudioSink* sink, int sampleRate) {
+	audioSink = sink;
+	memory->getApu().setSampleRate(sampleRate);
+	memory->getApu().setOutputEnabled(sink != nullptr);
+}
+
+Board* Board::fork() { return new Board(this); }
+
+void Board::unshare() { memory->unshare(); }
+
+void Board::setInputSource(const std::atomic<byte>* source) { memory->connectJoypadSource(source); }
+
+void Board::saveState(std::ostream& out) {
+	writeState(out, stateMagic);
+	writeState(out, stateVersion);
+	writeState(out, memory->getRomHash());
+	cpu.saveState(out);
+	interrupts.saveState(out);
+	memory->saveState(out);
+	serial.saveState(out);
+	lcd.saveState(out);
+}
+
+bool Board::loadState(std::istream& in) {
+	unsigned int magic = 0, version = 0;
+	uint64_t romHash = 0;
+	readState(in, magic);
+	readState(in, version);
+	readState(in, romHash);
+	if(!in || magic != stateMagic || version != stateVersion) {
+		std::cerr << "Not a compatible save state" << std::endl;
+		return false;
+	}
+	if(romHash != memory->getRomHash()) {
+		std::cerr << "Save state was made with a different ROM" << std::endl;
+		return false;
 	}
+	cpu.loadState(in);
+	interrupts.loadState(in);
+	memory->loadState(in);
+	serial.loadState(in);
+	lcd.loadState(in);
+	return (bool) in;
 }
@@ -4,24 +4,88 @@
 #include "cpu.hpp"
 #include "memory.hpp"
 #include "lcd.hpp"
+#include "timer.hpp"
+#include "serial.hpp"
+#include "audio.hpp"
 
 #include <iostream>
 #include <sstream>
 #include <string>
 
-class Board {
+// One Board is one allocation apart from the cartridge (MBC, shared ROM, external RAM),
+// the WRAM and VRAM pages and debug images. Layout, starting on a cache line, with what
+// Board::execute touches for every instruction first and the bulk of the LCD last:
+//   cpu            registers, ime, halt, clocks
+//   timer          DIV, TIMA, TMA, TAC
+//   interrupts     IE, IF and the pending mask the CPU tests
+//   memory         pointer into memoryStorage
+//   serial         SB, SC and the link; step only reads the clock of its next event
+//   memoryStorage  the Memory: master clock and page tables, then IO, HRAM, joypad, APU
+//   lcd            registers, line state and the PPU engines, then OAM, the screens and
+//                  the tile cache
+// An instruction without a slow access touches the first three cache lines (up to the
+// master clock), the page table entry of its pc and the first two lines of the LCD.
+class alignas(64) Board {
+public:
+	CPU cpu;
+	Timer timer;
+	InterruptController interrupts;
+	Memory* memory = nullptr;	// Lives in memoryStorage, nullptr if the ROM couldn't be loaded
+	Serial serial;
 private:
+	alignas(Memory) byte memoryStorage[sizeof(Memory)];
 public:
 	LCD lcd;
-	Memory* memory = nullptr;
-	CPU cpu;
+private:
+	AudioSink* audioSink = nullptr;
+
+	void connect();
+public:
 
 	Board(std::string filepath);
+	explicit Board(Board* parent);	// Fork of parent, see fork()
 	Board(const Board&) = delete;
 	~Board();
 
-	void run();
+	static const int clocksPerFrame = 70224;
+
 	void step();
+	void execute();		// The instruction at pc, step without the interrupt check before it
+	// Until the LCD completes a frame. With the LCD off it never does, then the frame ends
+	// after clocksPerFrame clocks so the caller still gets to poll input and present.
+	// Turning the LCD on doesn't end a frame.
+	void runFrame();
+	// Whether a frame that should have ended at frameEnd has to be ended by the clock:
+	// the LCD is off, or it's been on for two frames without completing one
+	bool isFrameOverdue(unsigned long long frameEnd);
+
+	// Host input; the joypad latches it at the start of runFrame
+	void setInputSource(const std::atomic<byte>*);
+
+	// Plugs a link cable into the serial port, nullptr unplugs it. The board on the other
+	// end has to run on its own thread.
+	void connectSerial(SerialPort*);
+
+	// Cable to a board stepped on the same thread, both ways; nullptr unplugs it
+	void connectSerialPeer(Board*);
+
+	// Audio is synthesized only while a sink is set, it receives the samples after every frame
+	void setAudioSink(AudioSink*, int sampleRate);
+
+	// Save states, tagged with the ROM hash
+	void saveState(std::ostream&);
+	bool loadState(std::istream&);
+
+	// New board continuing from the current state. ROM, WRAM, VRAM and cartrige RAM are
+	// shared copy-on-write, so each side only pays for the pages it writes afterwards.
+	// The Board itself is copied whole, which is a fixed floor of about 78 KB per fork:
+	// 73 KB of it is the LCD (the screen and its source data, the tile cache and the
+	// sprite index), which the renderer writes every line and the fork needs right away.
+	// The fork has no audio sink; the caller deletes it.
+	Board* fork();
+
+	// Takes private copies of the memory still shared with forks, so later writes never allocate
+	void unshare();
 };
 
 #endif
@@ -0,0 +1,80 @@
+#include "bootcache.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+BootCache::BootCache(std::string directory, Point point, int frames) : directory(directory), point(point), frames(frames) {}
+
+std::string BootCache::snapshotPath(Board& board) {
+	char name[80];
+	const char* points[] = { "power-on", "first-input", "frames" };
+	snprintf(name, sizeof(name), "%016llx-%016llx-%s", (unsigned long long) board.memory->getRomHash(),
+		(unsigned long long) board.memory->getCartridgeRamHash(), points[point]);
+	std::string path = (std::filesystem::path(directory) / name).string();
+	if(point == afterFrames) path += "-" + std::to_string(frames);
+	return path + ".state";
+}
+
+void BootCache::runToPoint(Board& board) {
+	if(point == firstInput) {
+		for(int i = 0; i < maxFramesToInput && !board.memory->wasJoypadPolled(); i++) board.runFrame();
+	} else if(point == afterFrames) {
+		for(int i = 0; i < frames; i++) board.runFrame();
+	}
+}
+
+bool BootCache::restore(Board& board) {
+	std::string path = snapshotPath(board);
+	std::ifstream file(path, std::ios::binary);
+	// Board::loadState checks the version and the ROM before it changes anything, and the
+	// files are never left half written, so a failed load leaves the board as it was
+	bool hostTime = board.memory->getRtcHostTime();
+	if(file.is_open() && board.loadState(file)) {
+		// The snapshot brings the cart RAM, clock and host time option it was taken with.
+		// The save file and this launch's option win, the clock must not go back.
+		board.memory->setRtcHostTime(hostTime);
+		board.memory->reloadSaveFile();
+		return true;
+	}
+	file.close();
+
+	runToPoint(board);
+
+	// Written to a temporary file of our own and renamed, so other processes see all of it
+	// or nothing even when several of them build the same snapshot at once
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	std::random_device random;
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%08x%08x.tmp", random(), random());
+	std::string temporaryPath = path + suffix;
+	std::ofstream out(temporaryPath, std::ios::binary);
+	board.saveState(out);
+	out.close();
+	bool written = (bool) out;
+	if(written) {
+		std::filesystem::rename(temporaryPath, path, error);
+		written = !error;
+	}
+	if(!written) {
+		std::cerr << "Can't write boot snapshot " << path << std::endl;
+		std::filesystem::remove(temporaryPath, error);
+	}
+	return false;
+}
+
+std::string BootCache::defaultDirectory() {
+#ifdef _WIN32
+	const char* localAppData = getenv("LOCALAPPDATA");
+	std::filesystem::path base = localAppData != nullptr ? localAppData : ".";
+#else
+	const char* cacheHome = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	std::filesystem::path base = cacheHome != nullptr && *cacheHome != 0 ? std::filesystem::path(cacheHome)
+		: home != nullptr ? std::filesystem::path(home) / ".cache" : std::filesystem::path(".");
+#endif
+	return (base / "gameboyemu").string();
+}
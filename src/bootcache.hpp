@@ -0,0 +1,41 @@
+#ifndef BOOTCACHE_HPP
+#define BOOTCACHE_HPP
+
+#include "defs.hpp"
+#include "board.hpp"
+
+#include <string>
+
+// Snapshots of boards shortly after power-on, kept in files so later launches of the same
+// ROM skip the boot and the game's intro. A snapshot is keyed by the hash of the ROM, the
+// cartridge RAM and saved clock the board booted with and the point it was taken at.
+class BootCache {
+public:
+	enum Point {
+		powerOn,		// Right after CPU::init
+		firstInput,		// End of the first frame in which the game read the joypad
+		afterFrames		// After a number of frames
+	};
+private:
+	std::string directory;
+	Point point;
+	int frames;
+
+	std::string snapshotPath(Board&);
+	void runToPoint(Board&);
+public:
+	static const int maxFramesToInput = 3600;	// Snapshot after a minute if the game never reads the joypad
+
+	BootCache(std::string directory, Point point = powerOn, int frames = 0);
+
+	// Brings a board that was just constructed (and had its save file opened) to the snapshot
+	// point. Loads the snapshot if there is one, otherwise runs the board there and stores
+	// it. Returns true if the snapshot was loaded; the RAM and clock of the save file and the
+	// RTC host time option stay as they were.
+	bool restore(Board&);
+
+	// $XDG_CACHE_HOME/gameboyemu, ~/.cache/gameboyemu or %LOCALAPPDATA%\gameboyemu
+	static std::string defaultDirectory();
+};
+
+#endif
@@ -0,0 +1,72 @@
+#include "conformance.hpp"
+#include "board.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+ConformanceRunner::ConformanceRunner(int threads, double maxSeconds) : threads(threads), maxSeconds(maxSeconds) {
+	if(this->threads <= 0) this->threads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+TestResult ConformanceRunner::run(std::string romFilepath) {
+	TestResult result;
+	result.romFilepath = romFilepath;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	Board board(romFilepath);
+	if(board.memory == nullptr) return result;
+	board.serial.setCapture(&result.output);
+
+	// Bounded by emulated clocks rather than frames, whether the LCD completes frames or not.
+	// Only the end of the output can hold a new verdict.
+	const unsigned long long maxClocks = (unsigned long long) (maxSeconds * 4194304);
+	size_t searchFrom = 0;
+	result.verdict = TestResult::timedOut;
+	while(board.memory->clockCounter < maxClocks) {
+		board.runFrame();
+		if(result.output.size() == searchFrom) continue;
+
+		if(result.output.find("Passed", searchFrom) != std::string::npos) result.verdict = TestResult::passed;
+		else if(result.output.find("Failed", searchFrom) != std::string::npos) result.verdict = TestResult::failed;
+		if(result.verdict != TestResult::timedOut) break;
+		searchFrom = result.output.size() < 5 ? 0 : result.output.size() - 5;
+	}
+
+	board.serial.setCapture(nullptr);
+	result.emulatedSeconds = board.memory->clockCounter / 4194304.0;
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+std::vector<TestResult> ConformanceRunner::run(const std::vector<std::string>& romFilepaths) {
+	std::vector<TestResult> results(romFilepaths.size());
+	std::atomic<size_t> next(0);
+	auto work = [&]() {
+		for(size_t i; (i = next++) < romFilepaths.size();)
+			results[i] = run(romFilepaths[i]);
+	};
+
+	std::vector<std::thread> workers;
+	for(int i = 1; i < threads && i < (int) romFilepaths.size(); i++) workers.emplace_back(work);
+	work();
+	for(std::thread& worker : workers) worker.join();
+	return results;
+}
+
+std::vector<std::string> ConformanceRunner::findRoms(const std::vector<std::string>& paths) {
+	std::vector<std::string> roms;
+	for(const std::string& path : paths) {
+		std::error_code error;
+		if(!std::filesystem::is_directory(path, error)) {
+			roms.push_back(path);
+			continue;
+		}
+		for(const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(path, error))
+			if(entry.is_regular_file() && entry.path().extension() == ".gb") roms.push_back(entry.path().string());
+	}
+	std::sort(roms.begin(), roms.end());
+	return roms;
+}
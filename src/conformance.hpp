@@ -0,0 +1,37 @@
+#ifndef CONFORMANCE_HPP
+#define CONFORMANCE_HPP
+
+#include <string>
+#include <vector>
+
+// Headless runs of test ROMs (Blargg's cpu_instrs, instr_timing, mem_timing, ...) that
+// print their result over the serial port. A run stops at the end of the frame in which
+// "Passed" or "Failed" shows up in the output, or after maxSeconds of emulated time.
+struct TestResult {
+	enum Verdict { passed, failed, timedOut, notLoaded };
+
+	std::string romFilepath;
+	Verdict verdict = notLoaded;
+	std::string output;			// Everything the ROM sent
+	double emulatedSeconds = 0;
+	double seconds = 0;			// Wall clock
+};
+
+class ConformanceRunner {
+private:
+	int threads;
+	double maxSeconds;
+public:
+	// threads = 0 uses one thread per hardware thread
+	ConformanceRunner(int threads = 0, double maxSeconds = 120);
+
+	TestResult run(std::string romFilepath);
+
+	// Runs the ROMs spread over the threads, results in the order of the ROMs
+	std::vector<TestResult> run(const std::vector<std::string>& romFilepaths);
+
+	// ROM files given directly and the .gb files in the given directories and below them, sorted
+	static std::vector<std::string> findRoms(const std::vector<std::string>& paths);
+};
+
+#endif
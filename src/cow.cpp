@@ -0,0 +1,48 @@
+#include "cow.hpp"
+#include <cstring>
+#include <algorithm>
+
+CowPages::CowPages() : blockPages(0), pageSize(0x100), totalSize(0) {}
+
+CowPages::CowPages(int size, int pageSize) : blockPages(0), pageSize(pageSize), totalSize(size) {
+	pages.resize((size + pageSize - 1) / pageSize);
+	allocateBlock();
+}
+
+// Points every page into a new zeroed block
+void CowPages::allocateBlock() {
+	block.reset(new byte[pageCount() * pageSize]());
+	for(int i = 0; i < pageCount(); i++) pages[i] = std::shared_ptr<byte[]>(block, block.get() + i * pageSize);
+	blockPages = pageCount();
+}
+
+byte* CowPages::writePage(int page) {
+	if(isShared(page)) {
+		std::shared_ptr<byte[]> copy(new byte[pageSize]);
+		std::memcpy(copy.get(), pages[page].get(), pageSize);
+		if(isInBlock(page)) blockPages--;
+		pages[page] = copy;
+	}
+	return pages[page].get();
+}
+
+void CowPages::unshareAll() {
+	bool shared = false;
+	for(int i = 0; i < pageCount() && !shared; i++) shared = isShared(i);
+	if(!shared) return;
+
+	std::vector<std::shared_ptr<byte[]>> old = pages;
+	allocateBlock();
+	for(int i = 0; i < pageCount(); i++) std::memcpy(pages[i].get(), old[i].get(), pageSize);
+}
+
+void CowPages::write(std::ostream& out) const {
+	for(int i = 0; i < pageCount(); i++)
+		out.write((const char*) readPage(i), std::min(pageSize, totalSize - i * pageSize));
+}
+
+void CowPages::read(std::istream& in) {
+	unshareAll();
+	for(int i = 0; i < pageCount(); i++)
+		in.read((char*) writePage(i), std::min(pageSize, totalSize - i * pageSize));
+}
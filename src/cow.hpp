@@ -0,0 +1,49 @@
+#ifndef COW_HPP
+#define COW_HPP
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "defs.hpp"
+
+// Memory split into pages that copies share until one of them writes to a page.
+// Copying a CowPages only copies the page pointers, writes copy the page first if shared.
+// The pages start out in one block, each page pointer aliases its part of it, so a fresh
+// or unshared CowPages is a single allocation; only pages copied on a write get their own.
+class CowPages {
+private:
+	std::vector<std::shared_ptr<byte[]>> pages;
+	std::shared_ptr<byte[]> block;
+	int blockPages;		// Pages of ours still pointing into block
+	int pageSize;
+	int totalSize;
+
+	bool isInBlock(int page) const {
+		return pages[page].get() >= block.get() && pages[page].get() < block.get() + pageCount() * pageSize;
+	}
+	void allocateBlock();
+public:
+	CowPages();
+	CowPages(int size, int pageSize = 0x100);
+
+	int size() const { return totalSize; }
+	int getPageSize() const { return pageSize; }
+	int pageCount() const { return (int) pages.size(); }
+
+	// Block pages share one count: ours are block itself and blockPages, anything beyond is a copy's
+	bool isShared(int page) const {
+		return isInBlock(page) ? block.use_count() > 1 + blockPages : pages[page].use_count() > 1;
+	}
+	const byte* readPage(int page) const { return pages[page].get(); }
+	byte* writePage(int page);
+	void unshareAll();		// One new block for all pages if any is shared
+
+	byte get(int offset) const { return pages[offset / pageSize][offset % pageSize]; }
+	void set(int offset, byte data) { writePage(offset / pageSize)[offset % pageSize] = data; }
+
+	// Raw contents for save states
+	void write(std::ostream&) const;
+	void read(std::istream&);
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "cpu.hpp"
+#include "state.hpp"
 #include <iostream>
 
 CPU::CPU() {
@@ -11,6 +12,10 @@ void CPU::connectMemory(Memory* memory) {
 	mem = memory;
 }
 
+void CPU::connectInterrupts(InterruptController* controller) {
+	interrupts = controller;
+}
+
 void CPU::init() {
 	// Init CPU registers
 	regs.pc = 0x0100;
@@ -61,6 +66,28 @@ void CPU::init() {
 	delayIme = false;
 
 	skipNext = false;
+	halt = false;
+	stop = false;
+}
+
+void CPU::saveState(std::ostream& out) {
+	writeState(out, regs);
+	writeState(out, ime);
+	writeState(out, delayIme);
+	writeState(out, clocks);
+	writeState(out, halt);
+	writeState(out, stop);
+	writeState(out, skipNext);
+}
+
+void CPU::loadState(std::istream& in) {
+	readState(in, regs);
+	readState(in, ime);
+	readState(in, delayIme);
+	readState(in, clocks);
+	readState(in, halt);
+	readState(in, stop);
+	readState(in, skipNext);
 }
 
 void CPU::exec(byte opcode) {
@@ -2144,79 +2171,21 @@ void CPU::execExt(byte opcode) {
 	}
 }
 
-void CPU::handleInterrupts() {
-	if(ime) {
-		if((mem -> readByte(IE) & mem -> readByte(0xFF0F) & 0x01) != 0) {	// VBLANK interrupt
-			//std::cout << "VBLANK interupt triggered" << std::endl;
-			mem -> writeByte(0xFF0F, mem -> readByte(0xFF0F) & 0xFE);	// Clear coresponfing IF flag
-			regs.sp -= 2;												// Write PC to stack
-			mem -> writeWord(regs.sp, regs.pc);
-			regs.pc = 0x40;												// Jump to interupt vector
-			if(halt) {
-				halt = false;											// Exit halt mode
-				clocks += 4;											// Extra time	
-			}
-			ime = false;												// Disable IME
-			clocks += 20;							
-		}
-		else if((mem -> readByte(IE) & mem -> readByte(0xFF0F) & 0x02) != 0) {	// LCD STAT interrput
-			std::cout << "STAT interupt triggered" << std::endl;
-			mem -> writeByte(0xFF0F, mem -> readByte(0xFF0F) & 0xFD);	// Clear coresponfing IF flag
-			regs.sp -= 2;												// Write PC to stack
-			mem -> writeWord(regs.sp, regs.pc);
-			regs.pc = 0x48;												// Jump to interupt vector
-			if(halt) {
-				halt = false;											// Exit halt mode
-				clocks += 4;											// Extra time	
-			}
-			ime = false;												// Disable IME
-			clocks += 20;
-		}
-		else if((mem -> readByte(IE) & mem -> readByte(0xFF0F) & 0x04) != 0) {	// Timer interrupt
-			std::cout << "TIMER interupt triggered" << std::endl;
-			mem -> writeByte(0xFF0F, mem -> readByte(0xFF0F) & 0xFB);	// Clear coresponfing IF flag
-			regs.sp -= 2;												// Write PC to stack
-			mem -> writeWord(regs.sp, regs.pc);
-			regs.pc = 0x50;												// Jump to interupt vector
-			if(halt) {
-				halt = false;											// Exit halt mode
-				clocks += 4;											// Extra time	
-			}
-			ime = false;												// Disable IME
-			clocks += 20;
-		}
-		else if((mem -> readByte(IE) & mem -> readByte(0xFF0F) & 0x08) != 0) {	// Serial interrupt
-			std::cout << "SERIAL interupt triggered" << std::endl;
-			mem -> writeByte(0xFF0F, mem -> readByte(0xFF0F) & 0xF7);	// Clear coresponfing IF flag
-			regs.sp -= 2;												// Write PC to stack
-			mem -> writeWord(regs.sp, regs.pc);
-			regs.pc = 0x58;												// Jump to interupt vector
-			if(halt) {
-				halt = false;											// Exit halt mode
-				clocks += 4;											// Extra time	
-			}
-			ime = false;												// Disable IME
-			clocks += 20;
-		}
-		else if((mem -> readByte(IE) & mem -> readByte(0xFF0F) & 0x10) != 0) {	// Joypad interrupt
-			std::cout << "JOYPAD interupt triggered" << std::endl;
-			mem -> writeByte(0xFF0F, mem -> readByte(0xFF0F) & 0xFE);	// Clear coresponfing IF flag
-			regs.sp -= 2;												// Write PC to stack
-			mem -> writeWord(regs.sp, regs.pc);
-			regs.pc = 0x60;												// Jump to interupt vector
-			if(halt) {
-				halt = false;											// Exit halt mode
-				clocks += 4;											// Extra time	
-			}
-			ime = false;												// Disable IME
-			clocks += 20;
-		}
-	}
-	
-	if((mem -> readByte(IE) & mem -> readByte(0xFF0F) & 0x1F) != 0 && halt) {	// Exit halt regardles of IME
-		halt = false;
-		clocks += 4;
+// Only called with an interrupt pending. Halt ends regardless of IME.
+void CPU::serviceInterrupt() {
+	if(halt) {
+		halt = false;											// Exit halt mode
+		clocks += 4;											// Extra time
 	}
+	if(!ime) return;
+
+	int number = interrupts->next();
+	interrupts->acknowledge(number);							// Clear coresponfing IF flag
+	regs.sp -= 2;												// Write PC to stack
+	mem -> writeWord(regs.sp, regs.pc);
+	regs.pc = 0x40 + 8 * number;								// Jump to interupt vector
+	ime = false;												// Disable IME
+	clocks += 20;
 }
 
 byte CPU::incByte(byte op1) {
@@ -3,6 +3,7 @@
 
 #include "defs.hpp"
 #include "memory.hpp"
+#include "interrupts.hpp"
 
 class CPU {
 	public:
@@ -33,6 +34,7 @@ class CPU {
 
 		// Memory managment
 		Memory* mem;
+		InterruptController* interrupts;
 
 		// Time
 		int clocks;
@@ -47,15 +49,23 @@ class CPU {
 		~CPU();
 
 		void connectMemory(Memory*);
+		void connectInterrupts(InterruptController*);
 
 		void init();
 
 		void exec(byte);
 		void execExt(byte);
 
-		void handleInterrupts();
+		// Before every instruction
+		void handleInterrupts() {
+			if(interrupts->pending != 0) serviceInterrupt();
+		}
+
+		void saveState(std::ostream&);
+		void loadState(std::istream&);
 
 	private:
+		void serviceInterrupt();
 		byte incByte(byte);
 		byte decByte(byte);
 		byte rlc(byte);
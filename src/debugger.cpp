@@ -0,0 +1,302 @@
+#include "debugger.hpp"
+
+#include <csignal>
+#include <cstring>
+#include <sstream>
+
+static const char* registerNames[] = { "a", "f", "b", "c", "d", "e", "h", "l", "af", "bc", "de", "hl", "sp", "pc" };
+static const char* compareNames[] = { "==", "!=", "<", ">" };
+
+// CALL, conditional CALLs and RSTs, the instructions step over runs through
+static int callLength(byte opcode) {
+	if(opcode == 0xCD || opcode == 0xC4 || opcode == 0xCC || opcode == 0xD4 || opcode == 0xDC) return 3;
+	if((opcode & 0xC7) == 0xC7) return 1;
+	return 0;
+}
+
+static bool isReturn(byte opcode) {
+	return opcode == 0xC9 || opcode == 0xD9 || opcode == 0xC0 || opcode == 0xC8 || opcode == 0xD0 || opcode == 0xD8;
+}
+
+// Set by Ctrl+C while c runs, checked between frames
+static volatile std::sig_atomic_t interrupted = 0;
+static void onInterrupt(int) { interrupted = 1; }
+
+// No supported MBC selects more ROM banks than this
+static const unsigned maxBank = 0xFF;
+
+Debugger::Debugger(Board& board)
+	: board(board), breakpointCount(0), frameEnd(board.memory->clockCounter + Board::clocksPerFrame), watching(false) {}
+
+Debugger::~Debugger() {
+	if(watching) board.memory->setWatchpoints(nullptr);
+}
+
+uint32_t Debugger::key(int bank, word address) { return (uint32_t) bank << 16 | address; }
+
+int Debugger::bankOf(word address) {
+	return address >= 0x4000 && address < 0x8000 ? board.memory->getRomBank(address) : 0;
+}
+
+void Debugger::addBreakpoint(int bank, word address) {
+	if(address < 0x4000 || address >= 0x8000) bank = 0;
+	if(bank >= (int) bitmaps.size()) bitmaps.resize(bank + 1);
+	if(bitmaps[bank].empty()) bitmaps[bank].assign(0x10000 / 64, 0);
+
+	uint64_t bit = 1ULL << (address % 64);
+	if((bitmaps[bank][address / 64] & bit) == 0) breakpointCount++;
+	bitmaps[bank][address / 64] |= bit;
+	conditions.erase(key(bank, address));
+}
+
+void Debugger::addBreakpoint(int bank, word address, Condition condition) {
+	addBreakpoint(bank, address);
+	if(address < 0x4000 || address >= 0x8000) bank = 0;
+	conditions[key(bank, address)] = condition;
+}
+
+void Debugger::removeBreakpoint(int bank, word address) {
+	if(address < 0x4000 || address >= 0x8000) bank = 0;
+	if(bank >= (int) bitmaps.size() || bitmaps[bank].empty()) return;
+
+	uint64_t bit = 1ULL << (address % 64);
+	if((bitmaps[bank][address / 64] & bit) != 0) breakpointCount--;
+	bitmaps[bank][address / 64] &= ~bit;
+	conditions.erase(key(bank, address));
+}
+
+bool Debugger::hasBreakpoints() { return breakpointCount > 0; }
+
+void Debugger::addWatchpoint(word address, int accesses) {
+	watchpoints.add(address, accesses);
+	watching = true;
+	board.memory->setWatchpoints(&watchpoints);
+}
+
+void Debugger::removeWatchpoint(word address) {
+	watchpoints.remove(address);
+	watching = !watchpoints.isEmpty();
+	board.memory->setWatchpoints(watching ? &watchpoints : nullptr);
+}
+
+Watchpoints::Hit Debugger::getWatchpointHit() { return watchpointHit; }
+
+bool Debugger::takeWatchpointHit() {
+	if(!watchpoints.triggered) return false;
+	watchpoints.triggered = false;
+	watchpointHit = watchpoints.hit;
+	return true;
+}
+
+word Debugger::getRegister(Register reg) {
+	CPU& cpu = board.cpu;
+	switch(reg) {
+		case a: return cpu.regs.a;
+		case f: return cpu.regs.f;
+		case b: return cpu.regs.b;
+		case c: return cpu.regs.c;
+		case d: return cpu.regs.d;
+		case e: return cpu.regs.e;
+		case h: return cpu.regs.h;
+		case l: return cpu.regs.l;
+		case af: return cpu.regs.af;
+		case bc: return cpu.regs.bc;
+		case de: return cpu.regs.de;
+		case hl: return cpu.regs.hl;
+		case sp: return cpu.regs.sp;
+		default: return cpu.regs.pc;
+	}
+}
+
+bool Debugger::isBreakpoint() {
+	word address = board.cpu.regs.pc;
+	int bank = bankOf(address);
+	if(bank >= (int) bitmaps.size() || bitmaps[bank].empty()) return false;
+	if((bitmaps[bank][address / 64] >> (address % 64) & 1) == 0) return false;
+
+	std::unordered_map<uint32_t, Condition>::iterator found = conditions.find(key(bank, address));
+	if(found == conditions.end()) return true;
+	word value = getRegister(found->second.reg);
+	switch(found->second.compare) {
+		case equal: return value == found->second.value;
+		case notEqual: return value != found->second.value;
+		case less: return value < found->second.value;
+		default: return value > found->second.value;
+	}
+}
+
+Debugger::Stop Debugger::stepChecked(bool checkBreakpoint) {
+	board.cpu.handleInterrupts();
+	// A halted CPU stays at the same pc, it would hit its breakpoint on every step
+	if(checkBreakpoint && !board.cpu.halt && isBreakpoint()) return breakpoint;
+	board.execute();
+	return takeWatchpointHit() ? watchpoint : stepped;
+}
+
+template<bool breakpoints, bool watched> Debugger::Stop Debugger::runLoop() {
+	if(board.lcd.screenRedrawn) {
+		board.lcd.screenRedrawn = false;
+		board.memory->latchJoypad();
+		frameEnd = board.memory->clockCounter + Board::clocksPerFrame;
+	}
+	// One test per instruction for the end of the frame and a watchpoint hit together
+	bool first = true;
+	while(!(board.lcd.screenRedrawn | (watched && watchpoints.triggered))) {
+		board.cpu.handleInterrupts();
+		if(breakpoints && !first && !board.cpu.halt && isBreakpoint()) return breakpoint;
+		board.execute();
+		first = false;
+		// Same as Board::runFrame, the frame ends by the clock while the LCD is off
+		if(board.memory->clockCounter >= frameEnd && board.isFrameOverdue(frameEnd)) board.lcd.completeFrame();
+	}
+	if(watched && takeWatchpointHit()) return watchpoint;
+	board.memory->flushSave(false);
+	return frameDone;
+}
+
+Debugger::Stop Debugger::continueFrame() {
+	if(breakpointCount > 0) return watching ? runLoop<true, true>() : runLoop<true, false>();
+	return watching ? runLoop<false, true>() : runLoop<false, false>();
+}
+
+Debugger::Stop Debugger::step() { return stepChecked(false); }
+
+Debugger::Stop Debugger::stepOver() {
+	int length = callLength(board.memory->getByte(board.cpu.regs.pc));
+	if(length == 0) return step();
+
+	// Done when the stack is back where it was at the instruction after the call
+	word returnAddress = board.cpu.regs.pc + length;
+	word stackPointer = board.cpu.regs.sp;
+	Stop stop = stepChecked(false);
+	while(stop == stepped && (board.cpu.regs.pc != returnAddress || board.cpu.regs.sp != stackPointer))
+		stop = stepChecked(breakpointCount > 0);
+	return stop;
+}
+
+Debugger::Stop Debugger::runToReturn() {
+	// Interrupt handlers entered on the way return to the same stack, not above it
+	word stackPointer = board.cpu.regs.sp;
+	for(bool first = true;; first = false) {
+		byte opcode = board.memory->getByte(board.cpu.regs.pc);
+		Stop stop = stepChecked(!first && breakpointCount > 0);
+		if(stop != stepped) return stop;
+		if(isReturn(opcode) && board.cpu.regs.sp > stackPointer) return returned;
+	}
+}
+
+void Debugger::printState(std::ostream& out) {
+	CPU& cpu = board.cpu;
+	std::ios::fmtflags flags = out.flags();
+	out << std::hex << std::uppercase;
+	out << "PC: " << bankOf(cpu.regs.pc) << ":" << cpu.regs.pc << "  opcode " << (int) board.memory->getByte(cpu.regs.pc) << std::endl;
+	out << "AF: " << cpu.regs.af << "  BC: " << cpu.regs.bc << "  DE: " << cpu.regs.de << "  HL: " << cpu.regs.hl << std::endl;
+	out << "SP: " << cpu.regs.sp << "  top of stack " << board.memory->getByte(cpu.regs.sp + 1) * 0x100 + board.memory->getByte(cpu.regs.sp) << std::endl;
+	out << "LCDC: " << (int) board.lcd.LCDCreg << "  STAT: " << (int) board.lcd.STATreg << "  LY: " << (int) board.lcd.LYreg << std::endl;
+	out << "IE: " << (int) board.memory->getByte(IE) << "  IF: " << (int) board.memory->getByte(0xFF0F) << "  IME: " << cpu.ime << std::endl;
+	out.flags(flags);
+}
+
+// [bank:]address in hex
+static bool parseLocation(std::string text, int& bank, word& address) {
+	std::stringstream stream(text);
+	unsigned first = 0, second = 0;
+	char separator = 0;
+	if(!(stream >> std::hex >> first)) return false;
+	if(stream >> separator) {
+		if(separator != ':' || !(stream >> std::hex >> second)) return false;
+		if(first > maxBank || second > 0xFFFF) return false;
+		bank = first;
+		address = second;
+	} else {
+		if(first > 0xFFFF) return false;
+		bank = 0;
+		address = first;
+	}
+	return true;
+}
+
+static bool parseCondition(std::string text, Debugger::Condition& condition) {
+	size_t position = text.find_first_of("=!<>");
+	if(position == std::string::npos) return false;
+
+	std::string name = text.substr(0, position);
+	int reg = 0;
+	while(reg <= Debugger::pc && name != registerNames[reg]) reg++;
+	if(reg > Debugger::pc) return false;
+
+	int compare = 0;
+	while(compare <= Debugger::greater && text.compare(position, strlen(compareNames[compare]), compareNames[compare]) != 0) compare++;
+	if(compare > Debugger::greater) return false;
+
+	std::stringstream value(text.substr(position + strlen(compareNames[compare])));
+	unsigned number = 0;
+	if(!(value >> std::hex >> number)) return false;
+
+	condition.reg = (Debugger::Register) reg;
+	condition.compare = (Debugger::Compare) compare;
+	condition.value = number;
+	return true;
+}
+
+bool Debugger::command(const std::string& line, std::ostream& out) {
+	std::stringstream stream(line);
+	std::string name, location, conditionText;
+	stream >> name >> location >> conditionText;
+
+	Stop stop = stepped;
+	if(name.empty() || name == "s") stop = step();
+	else if(name == "n") stop = stepOver();
+	else if(name == "f") stop = runToReturn();
+	else if(name == "c") {
+		// With nothing to stop on a run would never return, then it's just the frame
+		interrupted = 0;
+		void (*previous)(int) = std::signal(SIGINT, onInterrupt);
+		do stop = continueFrame();
+		while(stop == frameDone && (breakpointCount > 0 || watching) && !interrupted);
+		if(previous != SIG_ERR) std::signal(SIGINT, previous);
+	}
+	else if(name == "r") {
+		printState(out);
+		return true;
+	} else if(name == "q") return false;
+	else if(name == "w" || name == "dw") {
+		std::stringstream addressText(location);
+		unsigned address = 0;
+		int accesses = conditionText == "r" ? Watchpoints::read
+			: conditionText == "rw" ? Watchpoints::read | Watchpoints::write : Watchpoints::write;
+		if(!(addressText >> std::hex >> address) || address > 0xFFFF) out << "Expected an address in hex" << std::endl;
+		else if(name == "dw") removeWatchpoint(address);
+		else addWatchpoint(address, accesses);
+		return true;
+	} else if(name == "b" || name == "d") {
+		int bank = 0;
+		word address = 0;
+		Condition condition;
+		if(!parseLocation(location, bank, address)) out << "Expected [bank:]address in hex" << std::endl;
+		else if(name == "d") removeBreakpoint(bank, address);
+		else if(conditionText.empty()) addBreakpoint(bank, address);
+		else if(parseCondition(conditionText, condition)) addBreakpoint(bank, address, condition);
+		else out << "Expected a condition like hl==C000" << std::endl;
+		return true;
+	} else {
+		out << "Commands: b [bank:]address [condition], d [bank:]address, w address [r|w|rw], dw address, s, n, f, c, r, q" << std::endl;
+		return true;
+	}
+
+	if(stop == breakpoint) out << "Breakpoint" << std::endl;
+	if(stop == watchpoint) {
+		std::ios::fmtflags flags = out.flags();
+		out << std::hex << std::uppercase << "Watchpoint: " << (watchpointHit.access == Watchpoints::read ? "read " : "write ")
+			<< watchpointHit.address << " = " << (int) watchpointHit.value << std::endl;
+		out.flags(flags);
+	}
+	printState(out);
+	return true;
+}
+
+void Debugger::console(std::istream& in, std::ostream& out) {
+	printState(out);
+	std::string line;
+	while(std::getline(in, line) && command(line, out));
+}
@@ -0,0 +1,106 @@
+#ifndef DEBUGGER_HPP
+#define DEBUGGER_HPP
+
+#include "defs.hpp"
+#include "board.hpp"
+#include "watchpoints.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Breakpoints and stepping for a Board. Execute breakpoints are a bit per address in a
+// 64K bitmap per ROM bank; the bank only matters for 0x4000 - 0x7FFF, breakpoints
+// anywhere else live in the bitmap of bank 0. A breakpoint can have a condition on a
+// register. Watchpoints stop after the instruction that read or wrote a watched address.
+// Without breakpoints and watchpoints the board runs through a loop that has no checks at all.
+class Debugger {
+public:
+	enum Register { a, f, b, c, d, e, h, l, af, bc, de, hl, sp, pc };
+	enum Compare { equal, notEqual, less, greater };
+
+	struct Condition {
+		Register reg;
+		Compare compare;
+		word value;
+	};
+
+	enum Stop {
+		breakpoint,
+		watchpoint,		// See getWatchpointHit
+		stepped,		// Single step or step over done
+		returned,		// Run to return done
+		frameDone
+	};
+private:
+	Board& board;
+
+	std::vector<std::vector<uint64_t>> bitmaps;	// Per ROM bank, empty until it gets a breakpoint
+	std::unordered_map<uint32_t, Condition> conditions;		// By bank << 16 | address
+	int breakpointCount;
+	unsigned long long frameEnd;	// Clock the current frame ends at if the LCD doesn't end it
+
+	Watchpoints watchpoints;
+	bool watching;
+	Watchpoints::Hit watchpointHit;
+
+	static uint32_t key(int bank, word address);
+	int bankOf(word address);
+	bool isBreakpoint();	// At pc, with its condition met
+
+	bool takeWatchpointHit();
+
+	// Runs until the frame is complete, a breakpoint if breakpoints or a watchpoint if watched. The instruction at pc
+	// runs first without a check, so continuing from a breakpoint doesn't stop right there.
+	template<bool breakpoints, bool watched> Stop runLoop();
+
+	// One instruction, or breakpoint without running it if checkBreakpoint and it has one.
+	// Returns watchpoint if it accessed a watched address.
+	Stop stepChecked(bool checkBreakpoint);
+public:
+	Debugger(Board&);
+	Debugger(const Debugger&) = delete;
+	~Debugger();
+
+	// bank is ignored outside 0x4000 - 0x7FFF
+	void addBreakpoint(int bank, word address);
+	void addBreakpoint(int bank, word address, Condition);
+	void removeBreakpoint(int bank, word address);
+	bool hasBreakpoints();
+
+	// accesses is Watchpoints::read, write or both
+	void addWatchpoint(word address, int accesses);
+	void removeWatchpoint(word address);
+	Watchpoints::Hit getWatchpointHit();	// The access that stopped the last run
+
+	word getRegister(Register);
+
+	// Until the end of the current frame or a breakpoint
+	Stop continueFrame();
+	Stop step();
+	// Runs calls and RSTs until they return, other instructions are a single step
+	Stop stepOver();
+	// Until the current function returns
+	Stop runToReturn();
+
+	void printState(std::ostream&);
+
+	// Runs a command, false on quit:
+	//   b [bank:]address [register==|!=|<|>value]   breakpoint, numbers in hex
+	//   d [bank:]address                            delete a breakpoint
+	//   w address [r|w|rw]                          watch writes, reads or both, writes by default
+	//   dw address                                  delete a watchpoint
+	//   s or an empty line                          step
+	//   n                                           step over
+	//   f                                           run to return
+	//   c                                           continue until a breakpoint, a watchpoint or
+	//                                               Ctrl+C; just the frame without either
+	//   r                                           registers
+	//   q                                           quit
+	bool command(const std::string& line, std::ostream& out);
+	void console(std::istream& in, std::ostream& out);
+};
+
+#endif
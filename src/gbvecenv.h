@@ -0,0 +1,33 @@
+#ifndef GBVECENV_H
+#define GBVECENV_H
+
+/* C interface to VecEnv for loading from other languages (ctypes, cffi, ...) */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct gb_vecenv gb_vecenv;
+
+/* downsample is 1, 2 or 4, packed stores 4 pixels per byte, stack frames per observation.
+   Returns NULL if the ROM can't be loaded or the arguments are invalid. */
+gb_vecenv* gb_vecenv_create(const char* rom, int count, int downsample, int packed, int stack, int threads);
+void gb_vecenv_destroy(gb_vecenv*);
+
+int gb_vecenv_size(gb_vecenv*);
+int gb_vecenv_observation_width(gb_vecenv*);
+int gb_vecenv_observation_height(gb_vecenv*);
+int gb_vecenv_observation_size(gb_vecenv*);
+
+/* ring holds slots * size * observation_size bytes. Reset and step return the slot written,
+   actions are one byte per env. */
+void gb_vecenv_set_ring(gb_vecenv*, unsigned char* ring, int slots);
+int gb_vecenv_reset(gb_vecenv*);
+void gb_vecenv_reset_one(gb_vecenv*, int index);
+int gb_vecenv_step(gb_vecenv*, const unsigned char* actions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit xxHash (XXH64) of a block of memory
+uint64_t hash64(const void* data, size_t len, uint64_t seed = 0);
+
+#endif
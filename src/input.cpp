@@ -0,0 +1,18 @@
+#include "input.hpp"
+#include "joypad.hpp"
+
+Input::Input() : keystates(0xFF), quitRequested(false) {}
+
+void Input::sample() {
+	SDL_Event e;
+	while(SDL_PollEvent(&e) != 0)
+		if(e.type == SDL_QUIT) quitRequested = true;
+
+	const Uint8* keys = SDL_GetKeyboardState(NULL);
+	if(keys[SDL_SCANCODE_ESCAPE]) quitRequested = true;
+	keystates.store(Joypad::keystatesFromKeyboard(keys), std::memory_order_relaxed);
+}
+
+const std::atomic<byte>* Input::getSource() { return &keystates; }
+byte Input::getKeystates() { return keystates.load(std::memory_order_relaxed); }
+bool Input::isQuitRequested() { return quitRequested; }
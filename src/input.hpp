@@ -0,0 +1,27 @@
+#ifndef INPUT_HPP
+#define INPUT_HPP
+
+#include "defs.hpp"
+#include "SDL.h"
+
+#include <atomic>
+
+// Samples the host keyboard into a joypad bitmask once per frame. The Joypad latches the
+// bitmask at the start of the next frame, so the emulation never calls into SDL.
+class Input {
+private:
+	std::atomic<byte> keystates;	// Same layout as Joypad::keystates; 0 means pressed
+	std::atomic<bool> quitRequested;
+public:
+	Input();
+	Input(const Input&) = delete;
+
+	// Polls the SDL event queue and keyboard state; call from the thread that owns the window
+	void sample();
+
+	const std::atomic<byte>* getSource();
+	byte getKeystates();
+	bool isQuitRequested();
+};
+
+#endif
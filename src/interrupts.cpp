@@ -0,0 +1,29 @@
+#include "interrupts.hpp"
+#include "state.hpp"
+
+InterruptController::InterruptController() : ieReg(0), ifReg(0), pending(0) {}
+
+byte InterruptController::getIE() { return ieReg; }
+
+void InterruptController::setIE(byte data) {
+	ieReg = data;
+	update();
+}
+
+byte InterruptController::getIF() { return ifReg; }
+
+void InterruptController::setIF(byte data) {
+	ifReg = data;
+	update();
+}
+
+void InterruptController::saveState(std::ostream& out) {
+	writeState(out, ieReg);
+	writeState(out, ifReg);
+}
+
+void InterruptController::loadState(std::istream& in) {
+	readState(in, ieReg);
+	readState(in, ifReg);
+	update();
+}
@@ -0,0 +1,62 @@
+#ifndef INTERRUPTS_HPP
+#define INTERRUPTS_HPP
+
+#include "defs.hpp"
+#include <iostream>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// IE and IF. Everything that raises, clears or enables an interrupt goes through here and
+// keeps pending up to date, so the CPU only tests one byte before each instruction.
+class InterruptController {
+private:
+	byte ieReg;		// Mapped to 0xFFFF
+	byte ifReg;		// Mapped to 0xFF0F
+
+	void update() { pending = ieReg & ifReg & 0x1F; }
+public:
+	// Bits in IE and IF, lowest bit has the highest priority
+	static const byte vblank = 0x01;
+	static const byte stat = 0x02;
+	static const byte timer = 0x04;
+	static const byte serial = 0x08;
+	static const byte joypad = 0x10;
+
+	byte pending;	// IE & IF & 0x1F
+
+	InterruptController();
+
+	void request(byte bits) {
+		ifReg |= bits;
+		update();
+	}
+
+	// Number of the highest priority pending interrupt, its vector is 0x40 + 8 * number
+	int next() {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, pending);
+		return index;
+#else
+		return __builtin_ctz(pending);
+#endif
+	}
+
+	// Clears the IF bit of an interrupt being serviced
+	void acknowledge(int number) {
+		ifReg &= ~(1 << number);
+		update();
+	}
+
+	byte getIE();
+	void setIE(byte);
+	byte getIF();
+	void setIF(byte);
+
+	void saveState(std::ostream&);
+	void loadState(std::istream&);
+};
+
+#endif
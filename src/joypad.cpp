@@ -1,45 +1,73 @@
 #include "joypad.hpp"
+#include "state.hpp"
 
 Joypad::Joypad() {
 	keystates = 0xFF;
 	p1reg = 0xFF;
-	interruptRequested = false;
+	polled = false;
+	interrupts = nullptr;
+	source = nullptr;
 }
 
 Joypad::~Joypad() {}
 
-void Joypad::updateKeystates(const Uint8 *keys) {
-	byte oldKeystates = keystates;
-	keystates = 0xFF;
-	if(keys[SDL_SCANCODE_RETURN])		keystates &= 0x7F;
-	if(keys[SDL_SCANCODE_BACKSPACE])	keystates &= 0xBF;
-	if(keys[SDL_SCANCODE_X])			keystates &= 0xDF;
-	if(keys[SDL_SCANCODE_Z])			keystates &= 0xEF;
-	if(keys[SDL_SCANCODE_DOWN])			keystates &= 0xF7;
-	if(keys[SDL_SCANCODE_UP])			keystates &= 0xFB;
-	if(keys[SDL_SCANCODE_LEFT])			keystates &= 0xFD;
-	if(keys[SDL_SCANCODE_RIGHT])		keystates &= 0xFE;
-
-	// Check for interrupts
-	if((p1reg & 0x20) == 0) {
-		for(int i = 0; i < 4; i++)
-			if((oldKeystates & 0x10 << i) == (keystates & 0x10 << i)) interruptRequested = true;
-	}
-	if((p1reg & 0x10) == 0) {
-		for(int i = 0; i < 4; i++)
-			if((oldKeystates & 0x01 << i) == (keystates & 0x01 << i)) interruptRequested = true;
-	}
+void Joypad::setKeystates(byte data) {
+	byte oldLines = selectedLines(keystates);
+	keystates = data;
+
+	// Interrupt on a high to low transition of any selected input line
+	if((oldLines & ~selectedLines(keystates) & 0x0F) != 0 && interrupts != nullptr) interrupts->request(InterruptController::joypad);
+}
+
+byte Joypad::selectedLines(byte keys) {
+	byte lines = 0x0F;
+	if((p1reg & 0x20) == 0) lines &= keys >> 4;
+	if((p1reg & 0x10) == 0) lines &= keys;
+	return lines;
+}
+
+byte Joypad::getKeystates() { return keystates; }
+
+byte Joypad::keystatesFromKeyboard(const Uint8 *keys) {
+	byte data = 0xFF;
+	if(keys[SDL_SCANCODE_RETURN])		data &= 0x7F;
+	if(keys[SDL_SCANCODE_BACKSPACE])	data &= 0xBF;
+	if(keys[SDL_SCANCODE_X])			data &= 0xDF;
+	if(keys[SDL_SCANCODE_Z])			data &= 0xEF;
+	if(keys[SDL_SCANCODE_DOWN])			data &= 0xF7;
+	if(keys[SDL_SCANCODE_UP])			data &= 0xFB;
+	if(keys[SDL_SCANCODE_LEFT])			data &= 0xFD;
+	if(keys[SDL_SCANCODE_RIGHT])		data &= 0xFE;
+	return data;
+}
+
+void Joypad::connectSource(const std::atomic<byte>* input) { source = input; }
+
+void Joypad::latch() {
+	if(source == nullptr) return;
+	byte data = source->load(std::memory_order_relaxed);
+	if(data != keystates) setKeystates(data);
 }
 
 void Joypad::setP1reg(byte data) { p1reg = data; }
 byte Joypad::getP1reg() { return p1reg; }
 void Joypad::writeP1reg(byte data) { p1reg = p1reg & 0xCF | data & 0x30; }
 byte Joypad::readP1reg() { 
-	byte pressedkeys = 0xFF;
-	if((p1reg & 0x20) == 0) pressedkeys &= keystates >> 4;
-	if((p1reg & 0x10) == 0) pressedkeys &= keystates;
-	return p1reg & 0xF0 | pressedkeys & 0x0F; 
+	if((p1reg & 0x30) != 0x30) polled = true;
+	return p1reg & 0xF0 | selectedLines(keystates); 
+}
+
+bool Joypad::wasPolled() { return polled; }
+
+void Joypad::connectInterrupts(InterruptController* controller) { interrupts = controller; }
+
+
+void Joypad::saveState(std::ostream& out) {
+	writeState(out, keystates);
+	writeState(out, p1reg);
 }
 
-bool Joypad::isInterruptRequested() { return interruptRequested; }
-void Joypad::setInterruptRequested(bool data) { interruptRequested = data; }
+void Joypad::loadState(std::istream& in) {
+	readState(in, keystates);
+	readState(in, p1reg);
+}
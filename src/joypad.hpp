@@ -2,28 +2,44 @@
 #define JOYPAD_HPP
 
 #include "defs.hpp"
+#include "interrupts.hpp"
 #include "SDL.h"
+#include <iostream>
+#include <atomic>
 
 class Joypad {
 private:
 	byte keystates;	// From MSB to LSB: start, select, B, A, down, up, left, right; 0 means pressesed
 	byte p1reg;
+	bool polled;	// The game read the buttons or the d-pad since power-on
 
-	bool interruptRequested;
+	InterruptController* interrupts;
+
+	const std::atomic<byte>* source;	// Host input sampled by Input, latched at emulated time
+
+	byte selectedLines(byte);
 public:
 	Joypad();
 	~Joypad();
 
-	void updateKeystates(const Uint8*);
+	void setKeystates(byte);
+	byte getKeystates();
+	static byte keystatesFromKeyboard(const Uint8*);
+
+	void connectSource(const std::atomic<byte>*);
+	void latch();
 	
 	void setP1reg(byte);
 	byte getP1reg();
 
 	void writeP1reg(byte);
 	byte readP1reg();
+	bool wasPolled();
+
+	void connectInterrupts(InterruptController*);
 
-	bool isInterruptRequested();
-	void setInterruptRequested(bool);
+	void saveState(std::ostream&);
+	void loadState(std::istream&);
 };
 
 #endif
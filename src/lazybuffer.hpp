@@ -0,0 +1,24 @@
+#ifndef LAZYBUFFER_HPP
+#define LAZYBUFFER_HPP
+
+#include <memory>
+
+// Buffer allocated on first use. Copies start out without one, so only the object
+// that actually uses the buffer pays for it.
+template<typename T> class LazyBuffer {
+private:
+	struct Storage { T data; };
+	std::unique_ptr<Storage> storage;
+public:
+	LazyBuffer() {}
+	LazyBuffer(const LazyBuffer&) {}
+	LazyBuffer& operator=(const LazyBuffer&) { return *this; }
+
+	T& get() {
+		if(storage == nullptr) storage.reset(new Storage());
+		return storage->data;
+	}
+	bool isAllocated() const { return storage != nullptr; }
+};
+
+#endif
@@ -1,7 +1,26 @@
 #include "lcd.hpp"
 #include "memory.hpp"
-
-LCD::LCD() {
+#include "state.hpp"
+#include "hash.hpp"
+#include "observation.hpp"
+#include "interrupts.hpp"
+#include <cstring>
+
+LCD::LCD() : vramData(new byte[0x2000]()) {
+	VRAM = vramData.get();
+	LCDCreg = STATreg = SCYreg = SCXreg = LYCreg = DMAreg = 0;
+	WYreg = WXreg = BGPreg = OBP0reg = OBP1reg = 0;
+	mem = nullptr;
+	observer = nullptr;
+	interrupts = nullptr;
+	spriteIndexDirty = true;
+	fifoEnabled = false;
+	renderingEnabled = true;
+	screenRedrawn = false;
+	frameHash = 0;
+	frameUnchanged = false;
+	for(int i = 0; i < 0x90; i++) lineHashes[i] = 0;
+	for(int i = 0; i < 3; i++) dirtyLines[i] = ~0ULL;
 	init();
 }
 
@@ -14,31 +33,69 @@ void LCD::init() {
 	columnRendering = 0;
 	clocksSpentInLine = 0;
 	setStatMode(2);
-	dmaClocksLeft = 0;
 	frameCount = 0;
+}
+
+PPUEngine& LCD::ppu() {
+	if(fifoEnabled) return fifoPPU;
+	return scanlinePPU;
+}
+
+void LCD::setFifoPPU(bool enabled) {
+	fifoEnabled = enabled;
+	if((STATreg & 0x03) == 3) ppu().beginLine(*this);
+}
+
+bool LCD::isFifoPPU() { return fifoEnabled; }
+
+void LCD::setObserver(Observer* observer) { this->observer = observer; }
+
+void LCD::connectInterrupts(InterruptController* controller) { interrupts = controller; }
+
+// Hashes every line, the frame hash is taken over the line hashes
+void LCD::finishFrame() {
+	if(!renderingEnabled) return;
+	for(int i = 0; i < 3; i++) dirtyLines[i] = 0;
+	for(int line = 0; line < 0x90; line++) {
+		uint64_t hash = hash64(screen[line], 0xA0);
+		if(hash != lineHashes[line]) dirtyLines[line / 64] |= 1ULL << (line % 64);
+		lineHashes[line] = hash;
+	}
+	frameHash = hash64(lineHashes, sizeof(lineHashes));
+	frameUnchanged = (dirtyLines[0] | dirtyLines[1] | dirtyLines[2]) == 0;
+	if(observer != nullptr) observer->capture(screen);
+}
+
+void LCD::completeFrame() {
+	frameCount++;
+	finishFrame();
 	screenRedrawn = true;
 }
 
+bool LCD::isLineDirty(int line) const { return (dirtyLines[line / 64] >> (line % 64) & 1) != 0; }
+
+void LCD::unshareVram() {
+	std::shared_ptr<byte[]> copy(new byte[0x2000]);
+	memcpy(copy.get(), VRAM, 0x2000);
+	vramData = copy;
+	VRAM = vramData.get();
+}
+
 void LCD::turnOff() {
 	setStatMode(1);
 }
 
 void LCD::run(int clocks) {
 	for(int i = 0; i < clocks; i += 4) {
-		if(dmaClocksLeft > 0) dmaTransfer(DMAreg);
-
 		if((LCDCreg & 0x80) != 0) {
 			if(clocksSpentInLine == 4 && LYreg != 0) {
 				if(LYreg == LYCreg) STATreg |= 0x04;
 			} else STATreg &= 0xFB;
 			if(clocksSpentInLine == 80 && (STATreg & 0x03) != 1) {
 				setStatMode(3); 
-			}
-			if(clocksSpentInLine == 172 && (STATreg & 0x03) != 1) {
+				ppu().beginLine(*this);
+			} else if((STATreg & 0x03) == 3 && ppu().run(*this, 4)) {
 				setStatMode(0);
-				renderBackgroundLine();
-				renderWindowLine();
-				renderSpritesLine();
 			}
 			if(clocksSpentInLine == 456) {
 				if((STATreg & 0x03) != 1 || LYreg == 143)setStatMode(2);
@@ -47,14 +104,13 @@ void LCD::run(int clocks) {
 			}
 			if(LYreg == 144 && clocksSpentInLine == 4) {
 				setStatMode(1);
-				mem -> writeByte(0xFF0F, mem -> readByte(0xFF0F) | 0x01); // Request VBLANK interupt
+				interrupts->request(InterruptController::vblank);
 			}
 			if(LYreg == 154) {
 				setStatMode(2);
 				clocksSpentInLine = 0;
 				LYreg = 0;
-				frameCount++;
-				screenRedrawn = true;
+				completeFrame();
 			}
 			
 			clocksSpentInLine += 4;
@@ -62,14 +118,6 @@ void LCD::run(int clocks) {
 	}
 }
 
-void LCD::dmaTransfer(byte addr) {
-	word startAddr = 0x0000 | (addr << 8);
-	if(dmaClocksLeft > 160 * 4) { dmaClocksLeft -= 4; return; } // Write first byte on second tick
-	byte byteIndex = 160 - (dmaClocksLeft / 4);
-	mem -> setByte(0xFE00 + byteIndex, mem -> getByte(startAddr + byteIndex));
-	dmaClocksLeft -= 4;
-}
-
 void LCD::displayBGLineTest() {
 
 	byte bgY = SCYreg;
@@ -126,6 +174,7 @@ void LCD::displayBGLineTest() {
 }
 
 void LCD::dumpVramTiles() {
+	auto& vramTiles = this->vramTiles.get();
 	for(int i = 0x00; i < 24; i++) { 
 		for(int j = 0x00; j < 16; j++) { 
 			word tileAddr = 0x8000 + 16 * (i * 16 + j);
@@ -147,6 +196,7 @@ void LCD::dumpVramTiles() {
 }
 
 void LCD::dumpBackgorundTiles() {
+	auto& backgorundTiles = this->backgorundTiles.get();
 	word tileMapAddr = (LCDCreg & 0x08) == 0 ? 0x9800 : 0x9C00;
 	word tileDataAddr = (LCDCreg & 0x10) == 0 ? 0x9000 : 0x8000;
 	for(int i = 0; i < 32; i++) {
@@ -170,148 +220,111 @@ void LCD::dumpBackgorundTiles() {
 	}
 }
 
-void LCD::renderBackgroundLine() {
-	byte bgY = SCYreg;
-	byte bgX = SCXreg;
-	byte screenY = LYreg;
-	if(screenY >= 0x90) return;
-	byte screenX;
-
-	word tileDataSelect = (LCDCreg & 0x10) == 0 ? 0x9000 : 0x8000;
-	word tileMapSelect = (LCDCreg & 0x08) == 0 ? 0x9800 : 0x9C00;
-	bool bgEnable = (LCDCreg & 0x01) != 0;
+// Draws the 8 pixels of a bg/window tile row starting at screen x, pixels off screen are clipped
+void LCD::drawTileRow(byte screenY, int x, const byte* colorNums) {
+	for(int j = 0; j < 8; j++) {
+		unsigned int screenX = x + j;
+		if(screenX >= 0xA0) continue;
 
-	for(int i = 0; i < 0xA0; i++) {
-		screenX = i;
+		byte colorNum = colorNums[j];
+		byte color = (BGPreg >> colorNum * 2) & 0x03;
 
-		byte mapX = (bgX + screenX) % 256;
-		byte mapY = (bgY + screenY) % 256;
-		byte tileNumX = mapX / 8;
-		byte tileNumY = mapY / 8;
-		byte pxInTileX = mapX % 8;
-		byte pxInTileY = mapY % 8;
+		screen[screenY][screenX] = 3 - color;
+		screenSourceData[screenY][screenX] = colorNum;
+	}
+}
 
-		word tilePositionInMapMem = tileNumY * 32 + tileNumX;
-		word tileAddrInMapMem = tileMapSelect + tilePositionInMapMem;
-		byte tileNum = mem->readByte(tileAddrInMapMem);
-		word tileAddr = tileDataSelect + 16 * (tileDataSelect == 0x9000 ? (sbyte)tileNum : tileNum);
+// Tile cache index of a bg/window tile for the tile data area selected in LCDC
+int LCD::bgTileIndex(byte tileNum) {
+	return (LCDCreg & 0x10) == 0 ? 256 + (sbyte) tileNum : tileNum;
+}
 
-		byte upperTileByte = readByte(tileAddr + 2 * pxInTileY + 0);
-		byte lowerTileByte = readByte(tileAddr + 2 * pxInTileY + 1);
+// Color numbers of the row of a sprite on the current line, not flipped horizontally
+const byte* LCD::spriteRow(byte spriteNum) {
+	byte spriteY = OAM[spriteNum * 4] - 16;
+	byte tileNum = OAM[spriteNum * 4 + 2];
+	bool flipY = (OAM[spriteNum * 4 + 3] & 0x40) != 0;
+	byte lineDiff = LYreg - spriteY;
 
-		byte upperColorBit = (upperTileByte & (1 << (7 - pxInTileX))) >> (7 - pxInTileX);
-		byte lowerColorBit = (lowerTileByte & (1 << (7 - pxInTileX))) >> (7 - pxInTileX);
-		byte colorNum = upperColorBit << 1 | lowerColorBit;
-		byte color = (BGPreg & 3 << colorNum * 2) >> colorNum * 2;
+	if((LCDCreg & 0x04) != 0)
+		tileNum = lineDiff > 7 && !flipY ? tileNum | 0x01 : tileNum & 0xFE;
 
-		screen[screenY][screenX] = bgEnable ? 3-color: 0x00;
-		screenSourceData[screenY][screenX] = bgEnable ? colorNum : 0x00;
+	byte tileLineNum;
+	if(flipY) {
+		if(lineDiff > 7) tileLineNum = 15 - lineDiff;
+		else tileLineNum = 7 - lineDiff;
+	} else {
+		if(lineDiff > 7) tileLineNum = lineDiff - 8;
+		else tileLineNum = lineDiff;
 	}
+
+	return tileCache.row(VRAM, tileNum, tileLineNum);
 }
 
-void LCD::renderWindowLine() {
-	byte wY = WYreg;
-	byte wX = WXreg - 7;
-	if(wX < 0) wX = 0; // Watch out: weird behavior
+void LCD::renderBackgroundLine() {
 	byte screenY = LYreg;
 	if(screenY >= 0x90) return;
-	byte screenX;
-
-	if(screenY < wY) return;
-
-	word tileDataSelect = (LCDCreg & 0x10) == 0 ? 0x9000 : 0x8000;
-	word tileMapSelect = (LCDCreg & 0x40) == 0 ? 0x9800 : 0x9C00;
-	bool wEnable = (LCDCreg & 0x20) != 0;
-	if(!wEnable) return;
 
-	for(int i = wX; i < 0xA0; i++) {
-		screenX = i;
+	if((LCDCreg & 0x01) == 0) {
+		memset(screen[screenY], 0x00, 0xA0);
+		memset(screenSourceData[screenY], 0x00, 0xA0);
+		return;
+	}
 
-		byte mapX = (screenX - wX) % 256;
-		byte mapY = (screenY - wY) % 256;
-		byte tileNumX = mapX / 8;
-		byte tileNumY = mapY / 8;
-		byte pxInTileX = mapX % 8;
-		byte pxInTileY = mapY % 8;
+	byte mapY = SCYreg + screenY;
+	const byte* tileMap = VRAM + ((LCDCreg & 0x08) == 0 ? 0x1800 : 0x1C00) + (mapY / 8) * 32;
 
-		word tilePositionInMapMem = tileNumY * 32 + tileNumX;
-		word tileAddrInMapMem = tileMapSelect + tilePositionInMapMem;
-		byte tileNum = mem->readByte(tileAddrInMapMem);
-		word tileAddr = tileDataSelect + 16 * (tileDataSelect == 0x9000 ? (sbyte) tileNum : tileNum);
+	// One tile map fetch per 8 pixels, the first tile may start left of the screen
+	byte tileX = SCXreg / 8;
+	for(int x = -(SCXreg % 8); x < 0xA0; x += 8) {
+		drawTileRow(screenY, x, tileCache.row(VRAM, bgTileIndex(tileMap[tileX]), mapY % 8));
+		tileX = (tileX + 1) & 0x1F;
+	}
+}
 
-		byte upperTileByte = readByte(tileAddr + 2 * pxInTileY + 0);
-		byte lowerTileByte = readByte(tileAddr + 2 * pxInTileY + 1);
+void LCD::renderWindowLine() {
+	byte wY = WYreg;
+	byte wX = WXreg - 7;	// Watch out: weird behavior for WX < 7
+	byte screenY = LYreg;
+	if(screenY >= 0x90 || screenY < wY || wX >= 0xA0) return;
+	if((LCDCreg & 0x20) == 0) return;
 
-		byte upperColorBit = (upperTileByte & (1 << (7 - pxInTileX))) >> (7 - pxInTileX);
-		byte lowerColorBit = (lowerTileByte & (1 << (7 - pxInTileX))) >> (7 - pxInTileX);
-		byte colorNum = upperColorBit << 1 | lowerColorBit;
-		byte color = (BGPreg & 3 << colorNum * 2) >> colorNum * 2;
+	byte mapY = screenY - wY;
+	const byte* tileMap = VRAM + ((LCDCreg & 0x40) == 0 ? 0x1800 : 0x1C00) + (mapY / 8) * 32;
 
-		screen[screenY][screenX] = 3 - color;
-		screenSourceData[screenY][screenX] = colorNum;
-	}
+	for(int x = wX, tileX = 0; x < 0xA0; x += 8, tileX++)
+		drawTileRow(screenY, x, tileCache.row(VRAM, bgTileIndex(tileMap[tileX]), mapY % 8));
 }
 
 void LCD::renderSpritesLine() {
 	bool spriteEnable = (LCDCreg & 0x02) != 0;
 	if(!spriteEnable) return;
-	int spriteSize = (LCDCreg & 0x04) >> 2;
 
 	byte screenY = LYreg;
 	if(screenY >= 0x90) return;
 	byte screenX;
 
-	int spritesOnLine[10];
-	for(int i = 0; i < 10; i++) spritesOnLine[i] = -1;
-	findSpritesOnLine(spritesOnLine, screenY, spriteSize);
+	if(spriteIndexDirty) buildSpriteIndex();
 
-	for(int i = 0; i < 10; i++) {
-		if(spritesOnLine[i] == -1) break;
+	for(int i = 0; i < spriteCountOnLine[screenY]; i++) {
+		byte spriteNum = spritesOnLine[screenY][i];
 
-		byte spriteNum = spritesOnLine[i];
-
-		byte spriteY = OAM[spriteNum * 4] - 16;
 		byte spriteX = OAM[spriteNum * 4 + 1] - 8;
-		byte tileNum = OAM[spriteNum * 4 + 2];
 		byte attribs = OAM[spriteNum * 4 + 3];
 
 		bool behindBG = (attribs & 0x80) != 0;
-		bool flipY = (attribs & 0x40) != 0;
 		bool flipX = (attribs & 0x20) != 0;
 		byte paletteNum = (attribs & 0x10) >> 4;
 
-		byte lineDiff = screenY - spriteY;
-
-		word tileAddr;
-		if(spriteSize == 0) {
-			tileAddr = 0x8000 | tileNum << 4;
-		} else {
-			tileAddr = 0x8000 | (lineDiff > 7 && !flipY ? tileNum | 0x01 : tileNum & 0xFE) << 4;
-		}
-
-		word tileLineNum;
-
-		if(flipY) {
-			if(lineDiff > 7) tileLineNum = 15 - lineDiff;
-			else tileLineNum = 7 - lineDiff;
-		} else {
-			if(lineDiff > 7) tileLineNum = lineDiff - 8;
-			else tileLineNum = lineDiff;
-		}
-
-		byte upperTileByte = readByte(tileAddr + 2 * tileLineNum + 0);
-		byte lowerTileByte = readByte(tileAddr + 2 * tileLineNum + 1);
+		const byte* colorNums = spriteRow(spriteNum);
 		byte paletteReg = paletteNum == 0 ? OBP0reg : OBP1reg;
 
 		for(int j = 0; j < 8; j++) {
-			byte posX = flipX ? 7 - j : j;
-			screenX = spriteX + j;
-			if(screenX < 0 || screenX > 160) continue;
+			screenX = spriteX + j;	// Wraps around for sprites hanging off the left edge
+			if(screenX >= 0xA0) continue;
 
-			byte upperColorBit = (upperTileByte & (1 << (7 - posX))) >> (7 - posX);
-			byte lowerColorBit = (lowerTileByte & (1 << (7 - posX))) >> (7 - posX);
-			byte colorNum = upperColorBit << 1 | lowerColorBit;
-			byte color = (paletteReg & 3 << colorNum * 2) >> colorNum * 2;
+			byte colorNum = colorNums[flipX ? 7 - j : j];
+			byte color = (paletteReg >> colorNum * 2) & 0x03;
 
 			byte screenSourceDataNum = screenSourceData[screenY][screenX];
 
@@ -329,11 +342,19 @@ void LCD::renderSpritesLine() {
 	}
 }
 
-void LCD::findSpritesOnLine(int* spritesOnLine, int line, int spriteSize) {
-	int currSpriteInTable = 0;
-	for(int i = 0; i < 0xA0 && currSpriteInTable < 10; i+=4) 
-		if(line >= OAM[i] - 16 && line < OAM[i] - 16 + 8 + 8 * spriteSize)
-			spritesOnLine[currSpriteInTable++] = i / 4;
+void LCD::buildSpriteIndex() {
+	int spriteHeight = (LCDCreg & 0x04) != 0 ? 16 : 8;
+	for(int line = 0; line < 0x90; line++) spriteCountOnLine[line] = 0;
+
+	for(int i = 0; i < 40; i++) {
+		int top = OAM[i * 4] - 16;
+		int first = top < 0 ? 0 : top;
+		int last = top + spriteHeight > 0x90 ? 0x90 : top + spriteHeight;
+		for(int line = first; line < last; line++)
+			if(spriteCountOnLine[line] < 10)
+				spritesOnLine[line][spriteCountOnLine[line]++] = i;
+	}
+	spriteIndexDirty = false;
 }
 
 void LCD::setStatMode(byte mode) {
@@ -342,7 +363,9 @@ void LCD::setStatMode(byte mode) {
 
 void LCD::setByte(word addr, byte data) {
 	if(addr >= 0x8000 && addr < 0xA000) {
+		if(vramData.use_count() > 1) unshareVram();
 		VRAM[addr - 0x8000] = data;
+		tileCache.invalidate(addr - 0x8000);
 		//std::cout << "Memory acces in LCD controller: 0x" << std::hex << std::uppercase << addr << std::nouppercase << std::dec << std::endl;
 		//
 		//int a;
@@ -353,10 +376,13 @@ void LCD::setByte(word addr, byte data) {
 		//	int a = 2;
 		//}
 	}
-	else if(addr >= 0xFE00 && addr < 0xFEA0)
+	else if(addr >= 0xFE00 && addr < 0xFEA0) {
 		OAM[addr - 0xFE00] = data;
-	else if(addr == 0xFF40)
+		spriteIndexDirty = true;
+	} else if(addr == 0xFF40) {
+		if(((LCDCreg ^ data) & 0x04) != 0) spriteIndexDirty = true;	// Sprite size
 		LCDCreg = data;
+	}
 	else if(addr == 0xFF41)
 		STATreg = data;
 	else if(addr == 0xFF42)
@@ -432,9 +458,6 @@ void LCD::writeByte(word addr, byte data) {
 		setByte(0xFF40, data);
 	} else if(addr == 0xFF41) {
 		setByte(addr, data & 0xFC);
-	} else if(addr == 0xFF46) {
-		dmaClocksLeft = 4 + 4 * 160;
-		setByte(addr, data);
 	} else {
 		setByte(addr, data);
 	}
@@ -450,3 +473,64 @@ byte LCD::readByte(word addr) {
 		return getByte(addr);
 	}
 }
+
+void LCD::saveState(std::ostream& out) {
+	out.write((const char*) VRAM, 0x2000);
+	writeState(out, OAM);
+	writeState(out, screen);
+	writeState(out, screenSourceData);
+	writeState(out, LCDCreg);
+	writeState(out, STATreg);
+	writeState(out, SCYreg);
+	writeState(out, SCXreg);
+	writeState(out, LYreg);
+	writeState(out, LYCreg);
+	writeState(out, DMAreg);
+	writeState(out, WYreg);
+	writeState(out, WXreg);
+	writeState(out, BGPreg);
+	writeState(out, OBP0reg);
+	writeState(out, OBP1reg);
+	writeState(out, columnRendering);
+	writeState(out, clocksSpentInLine);
+	writeState(out, frameCount);
+	writeState(out, screenRedrawn);
+	writeState(out, frameHash);
+	writeState(out, frameUnchanged);
+	writeState(out, lineHashes);
+	writeState(out, dirtyLines);
+	writeState(out, fifoEnabled);
+	ppu().saveState(out);
+}
+
+void LCD::loadState(std::istream& in) {
+	if(vramData.use_count() > 1) unshareVram();
+	in.read((char*) VRAM, 0x2000);
+	readState(in, OAM);
+	readState(in, screen);
+	readState(in, screenSourceData);
+	readState(in, LCDCreg);
+	readState(in, STATreg);
+	readState(in, SCYreg);
+	readState(in, SCXreg);
+	readState(in, LYreg);
+	readState(in, LYCreg);
+	readState(in, DMAreg);
+	readState(in, WYreg);
+	readState(in, WXreg);
+	readState(in, BGPreg);
+	readState(in, OBP0reg);
+	readState(in, OBP1reg);
+	readState(in, columnRendering);
+	readState(in, clocksSpentInLine);
+	readState(in, frameCount);
+	readState(in, screenRedrawn);
+	readState(in, frameHash);
+	readState(in, frameUnchanged);
+	readState(in, lineHashes);
+	readState(in, dirtyLines);
+	readState(in, fifoEnabled);
+	ppu().loadState(in);
+	spriteIndexDirty = true;
+	tileCache.invalidateAll();
+}
@@ -3,19 +3,19 @@
 
 #include <iostream>
 #include "defs.hpp"
+#include "ppu.hpp"
+#include "lazybuffer.hpp"
+#include <cstdint>
+#include <memory>
 
 class Memory;
+class Observer;
+class InterruptController;
 
 class LCD {
 	private:
 	public:
-		byte screen[0x90][0xA0];
-		byte screenSourceData[0x90][0xA0]; // 0 - 3 for bg/win colors, 4 - 43 are spirtes
-		byte VRAM[0x2000];
-		byte OAM[0x100];
-
-		byte vramTiles[24 * 8][16 * 8];
-		byte backgorundTiles[32 * 8][32 * 8];
+		// Per dot state first, the bulk arrays after it
 
 		// Registers
 		byte LCDCreg; // Mapped to 0xFF40
@@ -34,29 +34,72 @@ class LCD {
 		byte columnRendering;
 		word clocksSpentInLine;
 
-		word dmaClocksLeft;
 		int frameCount;
 		bool screenRedrawn;
 
+		// Pixels are drawn by the fast scanline renderer unless the pixel FIFO is selected
+		bool fifoEnabled;
+		bool spriteIndexDirty;
+		bool renderingEnabled;	// Off the scanline renderer keeps the timing but draws nothing, for frames nobody sees
+
+		byte* VRAM;							// Points into vramData
 		Memory* mem;
+		InterruptController* interrupts;
+		Observer* observer;		// Gets every completed frame, not copied to forks
+
+		ScanlinePPU scanlinePPU;	// run dispatches into one of these every mode 3
+		FifoPPU fifoPPU;
+
+		byte OAM[0x100];
+
+		// Sprites on each line in OAM order, at most 10. Rebuilt lazily after OAM or the sprite size changes.
+		byte spritesOnLine[0x90][10];
+		byte spriteCountOnLine[0x90];
+
+		byte screen[0x90][0xA0];
+		byte screenSourceData[0x90][0xA0]; // 0 - 3 for bg/win colors, 4 - 43 are spirtes
+
+		// Filled in when a frame completes
+		uint64_t frameHash;
+		bool frameUnchanged;		// Same pixels as the frame before
+		uint64_t lineHashes[0x90];
+		uint64_t dirtyLines[3];		// Bit per line that changed since the frame before
+
+		TileCache tileCache;
+		std::shared_ptr<byte[]> vramData;	// Shared with forks until one of them writes
+
+		// Debug images, allocated by the first dump
+		LazyBuffer<byte[24 * 8][16 * 8]> vramTiles;
+		LazyBuffer<byte[32 * 8][32 * 8]> backgorundTiles;
 
 		LCD();
 		~LCD();
 
 		void init();
 		void turnOff();
+		void unshareVram();
+		void finishFrame();
+		void completeFrame();	// Ends the frame: hashes, the observer and screenRedrawn
+		bool isLineDirty(int) const;
 		void run(int);
 
-		void dmaTransfer(byte);
+		PPUEngine& ppu();
+		void setFifoPPU(bool);
+		bool isFifoPPU();
+		void setObserver(Observer*);
+		void connectInterrupts(InterruptController*);
 
 		void displayBGLineTest();
 		void dumpVramTiles();
 		void dumpBackgorundTiles();
 
+		void drawTileRow(byte, int, const byte*);
+		int bgTileIndex(byte);
+		const byte* spriteRow(byte);
 		void renderBackgroundLine();
 		void renderWindowLine();
 		void renderSpritesLine();
-		void findSpritesOnLine(int*, int, int);
+		void buildSpriteIndex();
 
 		void setStatMode(byte);
 
@@ -64,6 +107,9 @@ class LCD {
 		byte getByte(word);
 		void writeByte(word, byte);
 		byte readByte(word);
+
+		void saveState(std::ostream&);
+		void loadState(std::istream&);
 };
 
 #endif
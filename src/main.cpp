@@ -3,8 +3,18 @@
 #include "render.hpp"
 #include "memory.hpp"
 #include "board.hpp"
+#include "movie.hpp"
+#include "perfcounter.hpp"
+#include "conformance.hpp"
+#include "rollback.hpp"
+#include "pacer.hpp"
+#include "debugger.hpp"
+#include "hash.hpp"
 #include <iostream>
+#include <sstream>
+#include <vector>
 
+#include <atomic>
 #include <chrono>
 #include <thread>
 
@@ -16,24 +26,234 @@ int Adder::add(int x, int y) {
 	return x + y;
 }
 
+// Replays a movie headless and as fast as possible
+int replayMovie(std::string romFilepath, std::string movieFilepath, std::string wavFilepath) {
+	Movie movie;
+	if(!movie.load(movieFilepath)) return 1;
+
+	Board board(romFilepath);
+	if(board.memory == nullptr) return 1;
+	WavAudioSink* wav = nullptr;
+	if(!wavFilepath.empty()) {
+		wav = new WavAudioSink(wavFilepath, 48000);
+		board.setAudioSink(wav, 48000);
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool synced = movie.replay(board);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	double fps = movie.getFrameCount() / elapsed.count();
+	std::cout << "Replayed " << movie.getFrameCount() << " frames in " << elapsed.count() << " s (" 
+		<< fps << " fps, " << fps / 59.73 << "x real time)" << std::endl;
+	std::cout << (synced ? "Replay in sync" : "Replay desynced") << std::endl;
+
+	board.setAudioSink(nullptr, 48000);
+	delete wav;
+	return synced ? 0 : 2;
+}
+
+// Runs the same frames with both PPU engines and reports what the pixel FIFO costs
+int benchmarkPPU(std::string romFilepath, int frames) {
+	double msPerFrame[2];
+	for(int fifo = 0; fifo < 2; fifo++) {
+		Board board(romFilepath);
+		if(board.memory == nullptr) return 1;
+		board.lcd.setFifoPPU(fifo != 0);
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for(int i = 0; i < frames; i++) board.runFrame();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		msPerFrame[fifo] = elapsed.count() / frames;
+	}
+
+	std::cout << "Scanline PPU: " << msPerFrame[0] << " ms/frame" << std::endl;
+	std::cout << "Pixel FIFO PPU: " << msPerFrame[1] << " ms/frame (" << msPerFrame[1] / msPerFrame[0] << "x)" << std::endl;
+	return 0;
+}
+
+// Runs many boards one frame at a time in turn, the way batched environments do, and
+// reports the time and L1 data cache misses per frame
+int benchmarkInstances(std::string romFilepath, int instances) {
+	const int frames = 60;
+	std::vector<Board*> boards;
+	for(int i = 0; i < instances; i++) {
+		boards.push_back(new Board(romFilepath));
+		if(boards.back()->memory == nullptr) {
+			for(Board* board : boards) delete board;
+			return 1;
+		}
+	}
+
+	CacheMissCounter misses;
+	misses.start();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(int frame = 0; frame < frames; frame++)
+		for(Board* board : boards) board->runFrame();
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	misses.stop();
+
+	std::cout << instances << " instances: " << elapsed.count() / (frames * instances) << " ms/frame";
+	if(misses.isAvailable()) std::cout << ", " << misses.read() / (frames * instances) << " L1d misses/frame";
+	std::cout << std::endl;
+
+	for(Board* board : boards) delete board;
+	return 0;
+}
+
+// Runs test ROMs in parallel and prints a verdict for each
+int runConformance(std::vector<std::string> paths) {
+	std::vector<std::string> roms = ConformanceRunner::findRoms(paths);
+	ConformanceRunner runner;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<TestResult> results = runner.run(roms);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	const char* verdicts[] = { "PASS", "FAIL", "TIMEOUT", "NOT LOADED" };
+	int passed = 0;
+	for(const TestResult& result : results) {
+		std::cout << verdicts[result.verdict] << "  " << result.romFilepath << " (" << result.emulatedSeconds
+			<< " s emulated in " << result.seconds << " s)" << std::endl;
+		if(result.verdict == TestResult::passed) passed++;
+		else if(!result.output.empty()) std::cout << result.output << std::endl;
+	}
+	std::cout << passed << " of " << results.size() << " passed in " << elapsed.count() << " s" << std::endl;
+	return passed == (int) results.size() ? 0 : 2;
+}
+
+// Of the whole save state, registers, RAM, VRAM, serial and all
+static uint64_t stateHash(Board& board) {
+	std::ostringstream state;
+	board.saveState(state);
+	std::string bytes = state.str();
+	return hash64(bytes.data(), bytes.size());
+}
+
+// Plays both sides of a linked game over a loopback network with the given delay and
+// jitter, one thread per player at the Game Boy frame rate, and reports what the rollbacks cost
+int benchmarkRollback(std::string romFilepath, double delayMs, double jitterMs) {
+	const unsigned frames = 600;
+	LoopbackLink link(delayMs, jitterMs, 0.02);
+	RollbackSession* sessions[2];
+	for(int player = 0; player < 2; player++) sessions[player] = new RollbackSession(romFilepath, player, link.transport(player));
+	if(!sessions[0]->isLoaded() || !sessions[1]->isLoaded()) {
+		for(RollbackSession* session : sessions) delete session;
+		return 1;
+	}
+
+	std::atomic<int> finished(0);
+	auto play = [&](int player) {
+		RollbackSession& session = *sessions[player];
+		FramePacer pacer(std::chrono::nanoseconds(16742706));
+		pacer.start();
+		for(unsigned frame = 0; frame < frames;) {
+			// Changing inputs so that predictions fail now and then
+			byte keys = (frame / (11 + 6 * player)) % 3 == 0 ? 0xEE : 0xFF;
+			if(session.advanceFrame(keys)) frame++;
+			pacer.waitForNextFrame();
+		}
+		finished++;
+		while(session.getConfirmedFrame() < frames || finished < 2) {
+			session.poll();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	};
+	std::thread other(play, 1);
+	play(0);
+	other.join();
+
+	for(int player = 0; player < 2; player++) {
+		RollbackSession::Stats stats = sessions[player]->getStats();
+		std::cout << "Player " << player + 1 << ": " << stats.frames << " frames, " << stats.stalls << " stalls, "
+			<< stats.rollbacks << " rollbacks, " << stats.resimulatedFrames << " frames emulated again";
+		if(stats.resimulatedFrames > 0) std::cout << " at " << stats.resimulatedFrames / stats.resimulationSeconds << " frames/s";
+		std::cout << std::endl;
+	}
+	// Both sessions end at the same frame with the same inputs confirmed, so their boards
+	// have to match exactly
+	bool synced = stateHash(sessions[0]->board(0)) == stateHash(sessions[1]->board(0))
+		&& stateHash(sessions[0]->board(1)) == stateHash(sessions[1]->board(1));
+	std::cout << (synced ? "Players in sync" : "Players desynced") << std::endl;
+
+	for(RollbackSession* session : sessions) delete session;
+	return synced ? 0 : 2;
+}
+
+// Headless debugger on the console, see Debugger::command
+int debugRom(std::string romFilepath) {
+	Board board(romFilepath);
+	if(board.memory == nullptr) return 1;
+	Debugger debugger(board);
+	debugger.console(std::cin, std::cout);
+	return 0;
+}
+
 int main(int argc, char* args[]) {
+	// Usage: emu --conformance <rom or directory>...
+	if(argc > 1 && std::string(args[1]) == "--conformance")
+		return runConformance(std::vector<std::string>(args + 2, args + argc));
+
+	// Usage: emu <rom> [--record <movie> | --replay <movie> [--wav <file>] | --bench-ppu <frames>
+	//            | --bench-instances <count>] [--vsync] [--mute] [--audio-sync] [--fifo-ppu] [--rtc-host-time]
+	//            [--run-ahead <frames> [--run-ahead-instance]] [--boot-cache <power-on | first-input | frames>]
+	//            | --bench-rollback <delay ms> <jitter ms> | --debug
+	RenderOptions options;
+	std::string replayFilepath, wavFilepath;
+	int benchFrames = 0;
+	int benchInstances = 0;
+	bool debug = false;
+	double rollbackDelay = -1, rollbackJitter = 0;
+	for(int i = 2; i < argc; i++) {
+		std::string arg = args[i];
+		if(arg == "--record" && i + 1 < argc) options.movieFilepath = args[++i];
+		else if(arg == "--replay" && i + 1 < argc) replayFilepath = args[++i];
+		else if(arg == "--wav" && i + 1 < argc) wavFilepath = args[++i];
+		else if(arg == "--vsync") options.vsync = true;
+		else if(arg == "--mute") options.audio = false;
+		else if(arg == "--audio-sync") options.audioSync = true;
+		else if(arg == "--fifo-ppu") options.fifoPPU = true;
+		else if(arg == "--rtc-host-time") options.rtcHostTime = true;
+		else if(arg == "--run-ahead" && i + 1 < argc) options.runAheadFrames = std::stoi(args[++i]);
+		else if(arg == "--run-ahead-instance") options.runAheadSecondInstance = true;
+		else if(arg == "--boot-cache" && i + 1 < argc) {
+			std::string point = args[++i];
+			options.bootCache = true;
+			if(point == "first-input") options.bootPoint = BootCache::firstInput;
+			else if(point != "power-on") {
+				options.bootPoint = BootCache::afterFrames;
+				options.bootFrames = std::stoi(point);
+			}
+		}
+		else if(arg == "--bench-ppu" && i + 1 < argc) benchFrames = std::stoi(args[++i]);
+		else if(arg == "--bench-instances" && i + 1 < argc) benchInstances = std::stoi(args[++i]);
+		else if(arg == "--debug") debug = true;
+		else if(arg == "--bench-rollback" && i + 2 < argc) {
+			rollbackDelay = std::stod(args[++i]);
+			rollbackJitter = std::stod(args[++i]);
+		}
+	}
+	if(argc > 1 && !replayFilepath.empty())
+		return replayMovie(args[1], replayFilepath, wavFilepath);
+	if(argc > 1 && benchFrames > 0)
+		return benchmarkPPU(args[1], benchFrames);
+	if(argc > 1 && benchInstances > 0)
+		return benchmarkInstances(args[1], benchInstances);
+	if(argc > 1 && debug)
+		return debugRom(args[1]);
+	if(argc > 1 && rollbackDelay >= 0)
+		return benchmarkRollback(args[1], rollbackDelay, rollbackJitter);
+
 	printHello();
 	std::cout << Adder::add(1, 2) << std::endl;
 	std::cout << sizeof(char) << std::endl;
 
 
-	//for(long i = 0; i < 10000000; i++)
-	//	std::this_thread::sleep_for(std::chrono::nanoseconds(1));
-	std::chrono::nanoseconds a = std::chrono::nanoseconds(1200000000);
-	std::chrono::system_clock::time_point b = std::chrono::system_clock::now();
-	std::this_thread::sleep_until(b + a);
-	std::cout << sizeof(char) << std::endl;
-
 	//Memory mem("..\\..\\ROM\\Super Mario Land 2 - 6 Golden Coins (UE) (V1.2) [!].gb");
 	
 	
 	Render *render;
-	if(argc > 1) render = new Render(std::string(args[1]));
+	if(argc > 1) render = new Render(std::string(args[1]), options);
 	else render = new Render();
 	delete render;
 
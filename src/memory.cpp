@@ -1,59 +1,135 @@
 #include "memory.hpp"
+#include "hash.hpp"
+#include "state.hpp"
+#include <cstring>
+#include <ctime>
+#include <new>
+
+MBCBase::MBCBase(const byte *header, std::shared_ptr<std::vector<byte>> romData) : romData(romData) {
+	ramBanks = 0;
+	ramBankSize = 0;
 
-MBCBase::MBCBase(const byte *header, std::string filepath) {
 	romBnkNum = 2 << header[0x48];
 	if(header[0x48] == 0x52) romBnkNum = 72;
 	else if(header[0x48] == 0x53) romBnkNum = 80;
 	else if(header[0x48] == 0x54) romBnkNum = 96;
 	ramSize = header[0x49];
 
-	std::ifstream romFile(filepath, std::ios::binary);
-
 	// Check file length
-	romFile.seekg(0, std::ios_base::end);
-	std::streamoff len = romFile.tellg();
-	if(len < 0x4000 * romBnkNum) throw std::length_error("File to small");
+	if(romData->size() < (size_t) 0x4000 * romBnkNum) throw std::length_error("File to small");
+	romData->resize(0x4000 * romBnkNum);
 
-	// Read the ROM into banks
-	romFile.seekg(0, std::ios_base::beg);
-	rom = new byte*[romBnkNum];
+	// Split the ROM into banks
+	romHash = 0;
 	for(int i = 0; i < romBnkNum; i++) {
-		rom[i] = new byte[0x4000];
-		romFile.read((char*) rom[i], 0x4000);
+		rom.push_back(romData->data() + 0x4000 * i);
+		romHash = hash64(rom[i], 0x4000, romHash);	// Chained over the banks
 	}
-	romFile.close();
 }
 
 MBCBase::~MBCBase() {
-	if(rom != nullptr) {
-		for(int i = 0; i < romBnkNum; i++)
-			delete[] rom[i];
-		delete[] rom;
+	delete save;
+}
+
+void MBCBase::unshareRam() { ramExt.unshareAll(); }
+
+void MBCBase::allocateRam(int banks, int bankSize) {
+	ramBanks = banks;
+	ramBankSize = bankSize;
+	ramExt = CowPages(banks * bankSize);
+}
+
+byte MBCBase::readRam(int bank, int offset) {
+	if(bank >= ramBanks || offset >= ramBankSize) return 0xFF;
+	return ramExt.get(bank * ramBankSize + offset);
+}
+
+void MBCBase::writeRam(int bank, int offset, byte data) {
+	if(bank >= ramBanks || offset >= ramBankSize) return;
+	ramExt.set(bank * ramBankSize + offset, data);
+	if(save != nullptr) save->markDirty(bank * ramBankSize + offset);
+}
+
+bool MBCBase::openSave(std::string savepath) {
+	int ramBytes = ramExt.size();
+	int size = ramBytes + rtcSaveSize();
+	if(size == 0) return false;
+
+	delete save;
+	save = nullptr;
+	try {
+		save = new SaveFile(savepath, size);
+	} catch(const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return false;
+	}
+	reloadSave();
+	return true;
+}
+
+void MBCBase::reloadSave() {
+	if(save == nullptr) return;
+	int ramBytes = ramExt.size();
+	if(save->hasContents(ramBytes)) {
+		for(int page = 0; page < ramExt.pageCount(); page++)
+			memcpy(ramExt.writePage(page), save->contents() + page * ramExt.getPageSize(), ramExt.getPageSize());
+	}
+	if(rtcSaveSize() != 0 && save->hasContents(ramBytes + rtcSaveSize())) loadRtc(save->contents() + ramBytes);
+	save->clearDirty();		// Same as the file again
+}
+
+void MBCBase::flushSave(bool force) {
+	if(save == nullptr) return;
+	if(!force && !save->isFlushDue()) return;
+
+	if(rtcSaveSize() != 0) {
+		byte rtc[64];
+		saveRtc(rtc);
+		save->write(ramExt.size(), rtc, rtcSaveSize());
 	}
+	save->flush(ramExt, force);
+}
+
+void MBCBase::detachSave() { save = nullptr; }
+
+uint64_t MBCBase::getRomHash() { return romHash; }
+
+uint64_t MBCBase::getRamHash() {
+	uint64_t hash = 0;
+	for(int page = 0; page < ramExt.pageCount(); page++)
+		hash = hash64(ramExt.readPage(page), ramExt.getPageSize(), hash);
+	if(save != nullptr && rtcSaveSize() != 0 && save->hasContents(ramExt.size() + rtcSaveSize()))
+		hash = hash64(save->contents() + ramExt.size(), rtcSaveSize(), hash);
+	return hash;
+}
+byte* MBCBase::getRomPage(word) { return nullptr; }
+
+int MBCBase::getRomBank(word addr) {
+	byte* page = getRomPage(addr);
+	return page != nullptr ? (int) ((page - romData->data()) / 0x4000) : 0;
+}
+
+void MBCBase::saveState(std::ostream& out) {
+	ramExt.write(out);
+}
+
+void MBCBase::loadState(std::istream& in) {
+	ramExt.read(in);
+	if(save != nullptr) save->markAllDirty();
 }
 
 // --------------------------------- MBC1 member functions ---------------------------------------
 
-MBC1::MBC1(const byte *header, std::string filepath) : MBCBase(header, filepath) {
+MBC1::MBC1(const byte *header, std::shared_ptr<std::vector<byte>> romData) : MBCBase(header, romData) {
 	// Allocate external RAM
-	if(ramSize != 0) {
-		ramExt = new byte*[ramSize == 3 ? 4 : 1];
-		for(int i = 0; i < (ramSize == 3 ? 4 : 1); i++)
-			ramExt[i] = new byte[ramSize == 1 ? 0x800 : 0x2000];
-	}
+	if(ramSize != 0) allocateRam(ramSize == 3 ? 4 : 1, ramSize == 1 ? 0x800 : 0x2000);
 
 	romRamModeSelect = false;
 	disableExtRam = true;
 	romRamRegister = 0x01;
 }
 
-MBC1::~MBC1() {
-	if(ramExt != nullptr) {
-		for(int i = 0; i < (ramSize == 3 ? 4 : 1); i++)
-			delete[] ramExt[i];
-		delete[] ramExt;
-	}
-}
+MBCBase* MBC1::fork() { return new MBC1(*this); }
 
 byte MBC1::getByte(word addr) {
 	if(addr >= 0x0000 && addr <= 0x3FFF) {			// ROM fixed bank
@@ -61,7 +137,7 @@ byte MBC1::getByte(word addr) {
 	} else if(addr >= 0x4000 && addr <= 0x7FFF) {	// ROM switchable bank
 		return rom[romRamModeSelect ? romRamRegister & 0x1F : romRamRegister & 0x7F][addr - 0x4000];
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
-		return ramExt[romRamModeSelect ? (romRamRegister & 0x60) >> 5 : 0x00][addr - 0xA000];
+		return readRam(romRamModeSelect ? (romRamRegister & 0x60) >> 5 : 0x00, addr - 0xA000);
 	}
 	std::cerr << "Unknown memory acces in cartrige controller: 0x" << std::hex << std::uppercase << addr << std::nouppercase << std::dec << std::endl;
 	return 0xFF;
@@ -80,30 +156,43 @@ void MBC1::setByte(word addr, byte data) {
 	} else if(addr >= 0x6000 && addr <= 0x7FFF) {	// ROM/RAM mode select
 		romRamModeSelect = (data & 0x01) != 0;
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
-		ramExt[romRamModeSelect ? (romRamRegister & 0x60) >> 5 : 0x00][addr - 0xA000] = data;
+		writeRam(romRamModeSelect ? (romRamRegister & 0x60) >> 5 : 0x00, addr - 0xA000, data);
 	}
 }
 
 byte MBC1::readByte(word addr) { return getByte(addr); }
 void MBC1::writeByte(word addr, byte data) { setByte(addr, data); }
 
+byte* MBC1::getRomPage(word addr) {
+	int bank = addr < 0x4000 ? 0 : romRamModeSelect ? romRamRegister & 0x1F : romRamRegister & 0x7F;
+	return bank < romBnkNum ? rom[bank] + (addr & 0x3F00) : nullptr;
+}
+
+void MBC1::saveState(std::ostream& out) {
+	MBCBase::saveState(out);
+	writeState(out, romRamRegister);
+	writeState(out, romRamModeSelect);
+	writeState(out, disableExtRam);
+}
+
+void MBC1::loadState(std::istream& in) {
+	MBCBase::loadState(in);
+	readState(in, romRamRegister);
+	readState(in, romRamModeSelect);
+	readState(in, disableExtRam);
+}
+
 // --------------------------------- MBC2 member functions ---------------------------------------
 
-MBC2::MBC2(const byte *header, std::string filepath) : MBCBase(header, filepath) {
+MBC2::MBC2(const byte *header, std::shared_ptr<std::vector<byte>> romData) : MBCBase(header, romData) {
 	// Allocate external RAM
-	ramExt = new byte*[1];
-	ramExt[0] = new byte[512];
+	allocateRam(1, 512);
 
 	disableExtRam = true;
 	romRegister = 0x01;
 }
 
-MBC2::~MBC2() {
-	if(ramExt != nullptr) {
-		delete[] ramExt[0];
-		delete[] ramExt;
-	}
-}
+MBCBase* MBC2::fork() { return new MBC2(*this); }
 
 byte MBC2::getByte(word addr) {
 	if(addr >= 0x0000 && addr <= 0x3FFF) {			// ROM fixed bank
@@ -111,7 +200,7 @@ byte MBC2::getByte(word addr) {
 	} else if(addr >= 0x4000 && addr <= 0x7FFF) {	// ROM switchable bank
 		return rom[romRegister & 0x0F][addr - 0x4000];
 	} else if(addr >= 0xA000 && addr <= 0xA1FF) {	// External RAM
-		return ramExt[0][addr - 0xA000];
+		return readRam(0, addr - 0xA000);
 	}
 	std::cerr << "Unknown memory acces in cartrige controller: 0x" << std::hex << std::uppercase << addr << std::nouppercase << std::dec << std::endl;
 	return 0xFF;
@@ -124,27 +213,38 @@ void MBC2::setByte(word addr, byte data) {
 		if(data == 0x00) data = 0x01;	// Can't select 0th bank		
 		romRegister = data & 0x0F;
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
-		ramExt[0][addr - 0xA000] = data;
+		writeRam(0, addr - 0xA000, data);
 	}
 }
 
 byte MBC2::readByte(word addr) { return getByte(addr); }
 void MBC2::writeByte(word addr, byte data) { setByte(addr, data); }
 
+byte* MBC2::getRomPage(word addr) {
+	int bank = addr < 0x4000 ? 0 : romRegister & 0x0F;
+	return bank < romBnkNum ? rom[bank] + (addr & 0x3F00) : nullptr;
+}
+
+void MBC2::saveState(std::ostream& out) {
+	MBCBase::saveState(out);
+	writeState(out, romRegister);
+	writeState(out, disableExtRam);
+}
+
+void MBC2::loadState(std::istream& in) {
+	MBCBase::loadState(in);
+	readState(in, romRegister);
+	readState(in, disableExtRam);
+}
+
 // --------------------------------- MBCROM member functions ---------------------------------------
 
-MBCROM::MBCROM(const byte *header, std::string filepath) : MBCBase(header, filepath) {
+MBCROM::MBCROM(const byte *header, std::shared_ptr<std::vector<byte>> romData) : MBCBase(header, romData) {
 	// Allocate external RAM
-	ramExt = new byte*[1];
-	ramExt[0] = new byte[0x2000];
+	allocateRam(1, 0x2000);
 }
 
-MBCROM::~MBCROM() {
-	if(ramExt != nullptr) {
-		delete[] ramExt[0];
-		delete[] ramExt;
-	}
-}
+MBCBase* MBCROM::fork() { return new MBCROM(*this); }
 
 byte MBCROM::getByte(word addr) {
 	if(addr >= 0x0000 && addr <= 0x3FFF) {			// ROM fixed bank
@@ -152,7 +252,7 @@ byte MBCROM::getByte(word addr) {
 	} else if(addr >= 0x4000 && addr <= 0x7FFF) {	// ROM "second" bank
 		return rom[1][addr - 0x4000];
 	} else if(addr >= 0xA000 && addr <= 0xA1FF) {	// External RAM
-		return ramExt[0][addr - 0xA000];
+		return readRam(0, addr - 0xA000);
 	}
 	std::cerr << "Unknown memory acces in cartrige controller: 0x" << std::hex << std::uppercase << addr << std::nouppercase << std::dec << std::endl;
 	return 0xFF;
@@ -160,22 +260,20 @@ byte MBCROM::getByte(word addr) {
 
 void MBCROM::setByte(word addr, byte data) {
 	if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
-		ramExt[0][addr - 0xA000] = data;
+		writeRam(0, addr - 0xA000, data);
 	}
 }
 
 byte MBCROM::readByte(word addr) { return getByte(addr); }
 void MBCROM::writeByte(word addr, byte data) { setByte(addr, data); }
 
+byte* MBCROM::getRomPage(word addr) { return rom[addr < 0x4000 ? 0 : 1] + (addr & 0x3F00); }
+
 // --------------------------------- MBC3 member functions ---------------------------------------
 
-MBC3::MBC3(const byte *header, std::string filepath) : MBCBase(header, filepath) {
+MBC3::MBC3(const byte *header, std::shared_ptr<std::vector<byte>> romData) : MBCBase(header, romData) {
 	// Allocate external RAM
-	if(ramSize != 0) {
-		ramExt = new byte*[ramSize == 3 ? 4 : 1];
-		for(int i = 0; i < (ramSize == 3 ? 4 : 1); i++)
-			ramExt[i] = new byte[ramSize == 1 ? 0x800 : 0x2000];
-	}
+	if(ramSize != 0) allocateRam(ramSize == 3 ? 4 : 1, ramSize == 1 ? 0x800 : 0x2000);
 
 	rtcRamRegister = 0; 
 	rtcRamModeSelect = 0;
@@ -183,14 +281,126 @@ MBC3::MBC3(const byte *header, std::string filepath) : MBCBase(header, filepath)
 	romBankSelect = 1;
 	latchDataRegister = 1;
 	for(int i = 0; i < 5; i++) rtcRegisters[i] = 0;
+
+	rtcSeconds = 0;
+	rtcBaseClock = 0;
+	rtcBaseHostTime = time(nullptr);
+	rtcHalted = false;
+	rtcCarry = false;
+	rtcHostTime = false;
+}
+
+MBCBase* MBC3::fork() { return new MBC3(*this); }
+
+void MBC3::connectClock(const unsigned long long* masterClock) { clock = masterClock; }
+
+void MBC3::setRtcHostTime(bool hostTime) {
+	int64_t now = rtcNow();
+	rtcHostTime = hostTime;
+	rebaseRtc(now);
+}
+
+bool MBC3::getRtcHostTime() { return rtcHostTime; }
+
+int64_t MBC3::rtcNow() {
+	if(rtcHalted) return rtcSeconds;
+	if(rtcHostTime) {
+		int64_t elapsed = time(nullptr) - rtcBaseHostTime;
+		return rtcSeconds + (elapsed > 0 ? elapsed : 0);
+	}
+	return rtcSeconds + (int64_t) ((*clock - rtcBaseClock) / clocksPerSecond);
+}
+
+void MBC3::rebaseRtc(int64_t seconds) {
+	rtcSeconds = seconds;
+	rtcBaseClock = *clock;
+	rtcBaseHostTime = time(nullptr);
+}
+
+// The clock goes after the RAM like other emulators store it, all little endian: the current
+// seconds, minutes, hours, day low and day high as 32 bit values, the latched ones the same
+// way and the host time of the save as 64 bit seconds since the epoch
+static void writeLittleEndian(byte* out, uint64_t value, int bytes) {
+	for(int i = 0; i < bytes; i++) out[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static uint64_t readLittleEndian(const byte* in, int bytes) {
+	uint64_t value = 0;
+	for(int i = 0; i < bytes; i++) value |= (uint64_t) in[i] << (8 * i);
+	return value;
+}
+
+int MBC3::rtcSaveSize() { return 48; }
+
+void MBC3::saveRtc(byte* out) {
+	const int64_t dayWrap = 512LL * 86400;
+	int64_t now = rtcNow();
+	bool carry = rtcCarry || now >= dayWrap;
+	now %= dayWrap;
+	int days = (int) (now / 86400);
+
+	uint32_t current[5] = { (uint32_t) (now % 60), (uint32_t) (now / 60 % 60), (uint32_t) (now / 3600 % 24), (uint32_t) (days & 0xFF),
+		(uint32_t) ((days >> 8 & 0x01) | (rtcHalted ? 0x40 : 0) | (carry ? 0x80 : 0)) };
+	for(int i = 0; i < 5; i++) {
+		writeLittleEndian(out + 4 * i, current[i], 4);
+		writeLittleEndian(out + 20 + 4 * i, rtcRegisters[i], 4);
+	}
+	writeLittleEndian(out + 40, (uint64_t) time(nullptr), 8);
 }
 
-MBC3::~MBC3() {
-	if(ramExt != nullptr) {
-		for(int i = 0; i < (ramSize == 3 ? 4 : 1); i++)
-			delete[] ramExt[i];
-		delete[] ramExt;
+// With the host clock the time the emulator was closed counts too
+void MBC3::loadRtc(const byte* in) {
+	uint32_t current[5];
+	for(int i = 0; i < 5; i++) {
+		current[i] = (uint32_t) readLittleEndian(in + 4 * i, 4);
+		rtcRegisters[i] = (byte) readLittleEndian(in + 20 + 4 * i, 4);
 	}
+	int days = (current[3] & 0xFF) | (current[4] & 0x01) << 8;
+	rtcHalted = (current[4] & 0x40) != 0;
+	rtcCarry = (current[4] & 0x80) != 0;
+	rebaseRtc(days * 86400LL + (current[2] % 24) * 3600 + (current[1] % 60) * 60 + current[0] % 60);
+	rtcBaseHostTime = (int64_t) readLittleEndian(in + 40, 8);
+}
+
+// Copies the current time into the registers the game reads
+void MBC3::latchRtc() {
+	const int64_t dayWrap = 512LL * 86400;
+	int64_t now = rtcNow();
+	if(now >= dayWrap) {
+		rtcCarry = true;
+		rtcSeconds -= now / dayWrap * dayWrap;
+		now %= dayWrap;
+	}
+
+	int days = (int) (now / 86400);
+	rtcRegisters[0] = now % 60;
+	rtcRegisters[1] = now / 60 % 60;
+	rtcRegisters[2] = now / 3600 % 24;
+	rtcRegisters[3] = days & 0xFF;
+	rtcRegisters[4] = (days >> 8 & 0x01) | (rtcHalted ? 0x40 : 0) | (rtcCarry ? 0x80 : 0);
+}
+
+// Setting a register restarts the clock from the new value, which also resets the part of a second
+void MBC3::writeRtc(int reg, byte data) {
+	int64_t now = rtcNow() % (512LL * 86400);
+	int seconds = now % 60;
+	int minutes = now / 60 % 60;
+	int hours = now / 3600 % 24;
+	int days = (int) (now / 86400);
+
+	switch(reg) {
+		case 0: seconds = data & 0x3F; break;
+		case 1: minutes = data & 0x3F; break;
+		case 2: hours = data & 0x1F; break;
+		case 3: days = (days & 0x100) | data; break;
+		case 4:
+			days = (days & 0xFF) | (data & 0x01) << 8;
+			rtcHalted = (data & 0x40) != 0;
+			rtcCarry = (data & 0x80) != 0;
+			break;
+	}
+	rtcRegisters[reg] = data;
+	rebaseRtc(days * 86400LL + hours * 3600 + minutes * 60 + seconds);
 }
 
 byte MBC3::getByte(word addr) {
@@ -200,7 +410,7 @@ byte MBC3::getByte(word addr) {
 		return rom[romBankSelect & 0x7F][addr - 0x4000];
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
 		if(rtcRamModeSelect >= 0 && rtcRamModeSelect <= 3) {
-			return ramExt[rtcRamModeSelect][addr - 0xA000];
+			return readRam(rtcRamModeSelect, addr - 0xA000);
 		} else if(rtcRamModeSelect >= 0x8 && rtcRamModeSelect <= 0xC) {
 			return rtcRegisters[rtcRamModeSelect - 0x8];
 		}
@@ -218,12 +428,13 @@ void MBC3::setByte(word addr, byte data) {
 	} else if(addr >= 0x4000 && addr <= 0x5FFF) {	// RTC and RAM register select
 		rtcRamModeSelect = data & 0x0F;
 	} else if(addr >= 0x6000 && addr <= 0x7FFF) {	// ROM/RAM mode select
-		if(latchDataRegister == 0 && data == 1) int a = 1; // TODO latch data
+		if(latchDataRegister == 0 && data == 1) latchRtc();	// Latch on a 0 then 1 write
+		latchDataRegister = data;
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
 		if(rtcRamModeSelect >= 0 && rtcRamModeSelect <= 3) {
-			ramExt[rtcRamModeSelect][addr - 0xA000] = data;
+			writeRam(rtcRamModeSelect, addr - 0xA000, data);
 		} else if(rtcRamModeSelect >= 0x8 && rtcRamModeSelect <= 0xC) {
-			rtcRegisters[rtcRamModeSelect - 0x8] = data;
+			writeRtc(rtcRamModeSelect - 0x8, data);
 		}
 	}
 }
@@ -231,21 +442,57 @@ void MBC3::setByte(word addr, byte data) {
 byte MBC3::readByte(word addr) { return getByte(addr); }
 void MBC3::writeByte(word addr, byte data) { setByte(addr, data); }
 
+byte* MBC3::getRomPage(word addr) {
+	int bank = addr < 0x4000 ? 0 : romBankSelect & 0x7F;
+	return bank < romBnkNum ? rom[bank] + (addr & 0x3F00) : nullptr;
+}
+
+void MBC3::saveState(std::ostream& out) {
+	MBCBase::saveState(out);
+	writeState(out, rtcRamRegister);
+	writeState(out, rtcRamModeSelect);
+	writeState(out, disableExtRamAndTimer);
+	writeState(out, romBankSelect);
+	writeState(out, latchDataRegister);
+	writeState(out, rtcRegisters);
+	writeState(out, rtcSeconds);
+	writeState(out, rtcBaseClock);
+	writeState(out, rtcBaseHostTime);
+	writeState(out, rtcHalted);
+	writeState(out, rtcCarry);
+	writeState(out, rtcHostTime);
+}
+
+void MBC3::loadState(std::istream& in) {
+	MBCBase::loadState(in);
+	readState(in, rtcRamRegister);
+	readState(in, rtcRamModeSelect);
+	readState(in, disableExtRamAndTimer);
+	readState(in, romBankSelect);
+	readState(in, latchDataRegister);
+	readState(in, rtcRegisters);
+	readState(in, rtcSeconds);
+	readState(in, rtcBaseClock);
+	readState(in, rtcBaseHostTime);
+	readState(in, rtcHalted);
+	readState(in, rtcCarry);
+	readState(in, rtcHostTime);
+}
+
 // --------------------------------- Memory member functions -------------------------------------
 
-Memory::Memory(std::string filepath) { 
+Memory::Memory(std::string filepath) : workRam(0x2000) { 
 	this->filepath = filepath; 
-	std::ifstream romFile(filepath, std::ios::binary);
-
-	// Check file length
-	romFile.seekg(0, std::ios_base::end);
+	apu.connectClock(&clockCounter);
+	// Read the whole file, the MBC keeps it as the ROM
+	std::ifstream romFile(filepath, std::ios::binary | std::ios::ate);
 	std::streamoff len = romFile.tellg();
 	if(len < 0x150) throw std::length_error("File to small");
-
-	// Read the header
-	romFile.seekg(0x100, std::ios_base::beg);
-	romFile.read((char*) cartrigeHeader, 0x50);
+	std::shared_ptr<std::vector<byte>> romData = std::make_shared<std::vector<byte>>(len);
+	romFile.seekg(0, std::ios_base::beg);
+	romFile.read((char*) romData->data(), len);
 	romFile.close();
+	memcpy(cartrigeHeader, romData->data() + 0x100, 0x50);
 
 	// Validate nintendo logo
 	for(int i = 0; i < 0x30; i++) {
@@ -257,24 +504,55 @@ Memory::Memory(std::string filepath) {
 
 	// Construct the right MBC
 	if(cartrigeHeader[0x47] >= 0x01 && cartrigeHeader[0x47] <= 0x03)
-		mbc = new MBC1(cartrigeHeader, filepath);
+		mbc = new MBC1(cartrigeHeader, romData);
 	else if (cartrigeHeader[0x47] == 0x00 || cartrigeHeader[0x47] == 0x05 || cartrigeHeader[0x47] == 0x06)
-		mbc = new MBC2(cartrigeHeader, filepath);
+		mbc = new MBC2(cartrigeHeader, romData);
 	else if(cartrigeHeader[0x47] >= 0x08 && cartrigeHeader[0x47] <= 0x09)
-		mbc = new MBCROM(cartrigeHeader, filepath);	
+		mbc = new MBCROM(cartrigeHeader, romData);	
 	else if(cartrigeHeader[0x47] >= 0x0F && cartrigeHeader[0x47] <= 0x13)
-		mbc = new MBC3(cartrigeHeader, filepath);
+		mbc = new MBC3(cartrigeHeader, romData);
 	else 
 		throw std::invalid_argument("Not a supported MBC chip");
+
+	mbc->connectClock(&clockCounter);
+	mapPages();
 }
 
 Memory::~Memory() {
 	if(mbc != nullptr) { 
+		mbc->flushSave(true);
 		delete mbc; 
 		mbc = nullptr;
 	}
 }
 
+Memory* Memory::fork(void* storage) {
+	apu.catchUp();	// The fork's APU starts at the current clock
+	Memory* child = new (storage) Memory(*this);
+	child->mbc = mbc->fork();
+	child->mbc->detachSave();
+	child->mbc->connectClock(&child->clockCounter);
+	child->lcd = nullptr;
+	child->timer = nullptr;
+	child->serial = nullptr;
+	child->interrupts = nullptr;
+	child->watchpoints = nullptr;
+	child->apu.connectClock(&child->clockCounter);
+	child->apu.setOutputEnabled(false);
+
+	// Both sides lose write access to the pages they share now
+	mapPages();
+	child->mapPages();
+	return child;
+}
+
+void Memory::unshare() {
+	workRam.unshareAll();
+	mbc->unshareRam();
+	if(lcd != nullptr && lcd->vramData.use_count() > 1) lcd->unshareVram();
+	mapPages();
+}
+
 byte Memory::getByte(word addr) {
 	if(addr >= 0x0000 && addr <= 0x7FFF) {			// Cartrige
 		return mbc->getByte(addr);
@@ -283,19 +561,27 @@ byte Memory::getByte(word addr) {
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
 		return mbc->getByte(addr);
 	} else if(addr >= 0xC000 && addr <= 0xDFFF) {	// WRAM
-		return workRam[addr - 0xC000];
+		return workRam.get(addr - 0xC000);
 	} else if(addr >= 0xE000 && addr <= 0xFDFF) {	// Echo WRAM
-		return workRam[addr - 0xE000];
+		return workRam.get(addr - 0xE000);
 	} else if(addr >= 0xFE00 && addr < 0xFEA0) {	// OAM
 		return lcd->getByte(addr);
 	} else if(addr >= 0xFF00 && addr < 0xFF80) {	// IO ports
 		if(addr == 0xFF00)								// Joypad
 			return joypad.getP1reg();
+		if(addr == 0xFF01 || addr == 0xFF02)			// Serial
+			return serial->getByte(addr);
 		if(addr >= 0xFF04 && addr <= 0xFF07)			// Timer
-			return timer.getByte(addr);
+			return timer->getByte(addr);
+		if(addr == 0xFF0F)								// Interrupt flags
+			return interrupts->getIF();
+		if(addr >= 0xFF10 && addr <= 0xFF3F)			// Sound
+			return apu.getByte(addr);
 		if(addr >= 0xFF40 && addr <= 0xFF4B)			// LCD registers
 			return lcd->getByte(addr);
 		return IOPorts[addr - 0xFF00];
+	} else if(addr == 0xFFFF) {						// Interrupt enable
+		return interrupts->getIE();
 	} else if(addr >= 0xFF80 && addr < 0x10000) {	// High RAM
 		return highRam[addr - 0xFF80];
 	}
@@ -305,78 +591,111 @@ byte Memory::getByte(word addr) {
 void Memory::setByte(word addr, byte data) {
 	if(addr >= 0x0000 && addr <= 0x7FFF) {			// Cartrige
 		mbc->setByte(addr, data);
+		mapRomPages();
 	} else if(addr >= 0x8000 && addr <= 0x9FFF) {	// VRAM
 		lcd->setByte(addr, data);
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
 		mbc->setByte(addr, data);
-	} else if(addr >= 0xC000 && addr <= 0xDFFF) {	// WRAM
-		workRam[addr - 0xC000] = data;
-	} else if(addr >= 0xE000 && addr <= 0xFDFF) {	// Echo WRAM
-		workRam[addr - 0xE000] = data;
+	} else if(addr >= 0xC000 && addr <= 0xFDFF) {	// WRAM and echo
+		workRam.set((addr - 0xC000) & 0x1FFF, data);
+		mapWorkRamPages(!isDmaInProgress());	// The page may have been copied
 	} else if(addr >= 0xFE00 && addr < 0xFEA0) {	// OAM
 		lcd->setByte(addr, data);
 	} else if(addr >= 0xFF00 && addr < 0xFF80) {	// IO ports
 		if(addr == 0xFF00)								// Joypad
 			joypad.setP1reg(data);
+		if(addr == 0xFF01 || addr == 0xFF02)			// Serial
+			serial->setByte(addr, data);
 		if(addr >= 0xFF04 && addr <= 0xFF07)			// Timer
-			timer.setByte(addr, data);
+			timer->setByte(addr, data);
+		if(addr == 0xFF0F)								// Interrupt flags
+			interrupts->setIF(data);
+		if(addr >= 0xFF10 && addr <= 0xFF3F)			// Sound
+			apu.setByte(addr, data);
 		if(addr >= 0xFF40 && addr <= 0xFF4B)			// LCD registers
 			lcd->setByte(addr, data);
 		IOPorts[addr - 0xFF00] = data;
+	} else if(addr == 0xFFFF) {						// Interrupt enable
+		interrupts->setIE(data);
 	} else if(addr >= 0xFF80 && addr < 0x10000) {	// High RAM
 		highRam[addr - 0xFF80] = data;
 	}
 }
 
 
-byte Memory::readByte(word addr) {
+byte Memory::readByteSlow(word addr) {
+	if(watchpoints != nullptr && watchpoints->isWatched(addr, Watchpoints::read))
+		watchpoints->trigger(addr, getByte(addr), Watchpoints::read);
 	if(addr >= 0x0000 && addr <= 0x7FFF) {			// Cartrige
 		return mbc->readByte(addr);
 	} else if(addr >= 0x8000 && addr <= 0x9FFF) {	// VRAM
 		return lcd->readByte(addr);
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
 		return mbc->readByte(addr);
-	} else if(addr >= 0xC000 && addr <= 0xDFFF) {	// WRAM
-		return isDmaInProgress() ? 0xFF : workRam[addr - 0xC000];
-	} else if(addr >= 0xE000 && addr <= 0xFDFF) {	// Echo WRAM
-		return isDmaInProgress() ? 0xFF : workRam[addr - 0xE000];
+	} else if(addr >= 0xC000 && addr <= 0xFDFF) {	// WRAM and echo, unmapped during DMA or watched
+		if(isDmaInProgress()) return 0xFF;
+		if(!workRamMapped) mapWorkRamPages(true);
+		return workRam.get((addr - 0xC000) & 0x1FFF);
 	} else if(addr >= 0xFE00 && addr < 0xFEA0) {	// OAM
 		return lcd->getByte(addr);
 	} else if(addr >= 0xFF00 && addr < 0xFF80) {	// IO ports
 		if(addr == 0xFF00)								// Joypad
 			return joypad.readP1reg();
+		if(addr == 0xFF01 || addr == 0xFF02)			// Serial
+			return serial->getByte(addr);
 		if(addr >= 0xFF04 && addr <= 0xFF07)			// Timer
-			return timer.readByte(addr);
+			return timer->readByte(addr);
+		if(addr == 0xFF0F)								// Interrupt flags
+			return interrupts->getIF();
+		if(addr >= 0xFF10 && addr <= 0xFF3F)			// Sound
+			return apu.readByte(addr);
 		if(addr >= 0xFF40 && addr <= 0xFF4B)			// LCD registers
 			return lcd->readByte(addr);
 		return IOPorts[addr - 0xFF00];
+	} else if(addr == 0xFFFF) {						// Interrupt enable
+		return interrupts->getIE();
 	} else if(addr >= 0xFF80 && addr < 0x10000) {	// High RAM
 		return highRam[addr - 0xFF80];
 	}
 	return 0xFF;
 }
 
-void Memory::writeByte(word addr, byte data) {
+void Memory::writeByteSlow(word addr, byte data) {
+	if(watchpoints != nullptr && watchpoints->isWatched(addr, Watchpoints::write))
+		watchpoints->trigger(addr, data, Watchpoints::write);
 	if(addr >= 0x0000 && addr <= 0x7FFF) {			// Cartrige
 		mbc->writeByte(addr, data);
+		mapRomPages();	// Bank switches
 	} else if(addr >= 0x8000 && addr <= 0x9FFF) {	// VRAM
 		lcd->writeByte(addr, data);
 	} else if(addr >= 0xA000 && addr <= 0xBFFF) {	// External RAM
 		mbc->writeByte(addr, data);
-	} else if(addr >= 0xC000 && addr <= 0xDFFF) {	// WRAM
-		if(!isDmaInProgress()) workRam[addr - 0xC000] = data;
-	} else if(addr >= 0xE000 && addr <= 0xFDFF) {	// Echo WRAM
-		if(!isDmaInProgress()) workRam[addr - 0xE000] = data;
+	} else if(addr >= 0xC000 && addr <= 0xFDFF) {	// WRAM and echo, unmapped during DMA, shared or watched
+		if(isDmaInProgress()) return;
+		int offset = (addr - 0xC000) & 0x1FFF;
+		bool remap = !workRamMapped || workRam.isShared(offset / workRam.getPageSize());
+		workRam.set(offset, data);	// Copies the page if it's shared
+		if(remap) mapWorkRamPages(true);
 	} else if(addr >= 0xFE00 && addr < 0xFEA0) {	// OAM
 		lcd->writeByte(addr, data);
 	} else if(addr >= 0xFF00 && addr < 0xFF80) {	// IO ports
 		if(addr == 0xFF00)								// Joypad
 			joypad.writeP1reg(data);
+		if(addr == 0xFF01 || addr == 0xFF02)			// Serial
+			serial->setByte(addr, data);
 		if(addr >= 0xFF04 && addr <= 0xFF07)			// Timer
-			timer.writeByte(addr, data);
+			timer->writeByte(addr, data);
+		if(addr == 0xFF0F)								// Interrupt flags
+			interrupts->setIF(data);
+		if(addr >= 0xFF10 && addr <= 0xFF3F)			// Sound
+			apu.writeByte(addr, data);
 		if(addr >= 0xFF40 && addr <= 0xFF4B)			// LCD registers
 			lcd->writeByte(addr, data);
+		if(addr == 0xFF46)								// OAM DMA
+			startDma(data);
 		IOPorts[addr - 0xFF00] = data;
+	} else if(addr == 0xFFFF) {						// Interrupt enable
+		interrupts->setIE(data);
 	} else if(addr >= 0xFF80 && addr < 0x10000) {	// High RAM
 		highRam[addr - 0xFF80] = data;
 	}
@@ -409,11 +728,115 @@ void Memory::connectLCD(LCD * l) {
 	l->mem = this;
 }
 
-bool Memory::isDmaInProgress() { return lcd->dmaClocksLeft > 0; }
+void Memory::connectTimer(Timer* t) { timer = t; }
+void Memory::connectSerial(Serial* s) { serial = s; }
+
+void Memory::setRtcHostTime(bool hostTime) { mbc->setRtcHostTime(hostTime); }
+bool Memory::getRtcHostTime() { return mbc->getRtcHostTime(); }
+
+bool Memory::openSaveFile(std::string savepath) {
+	byte type = cartrigeHeader[0x47];
+	bool battery = type == 0x03 || type == 0x06 || type == 0x09 || type == 0x0F || type == 0x10 || type == 0x13;
+	if(!battery) return false;
+
+	if(savepath.empty()) {
+		savepath = filepath;
+		size_t dot = savepath.find_last_of('.');
+		size_t separator = savepath.find_last_of("/\\");
+		if(dot != std::string::npos && (separator == std::string::npos || dot > separator)) savepath.erase(dot);
+		savepath += ".sav";
+	}
+	return mbc->openSave(savepath);
+}
+
+void Memory::reloadSaveFile() { mbc->reloadSave(); }
+void Memory::flushSave(bool force) { mbc->flushSave(force); }
+
+void Memory::connectInterrupts(InterruptController* controller) {
+	interrupts = controller;
+	joypad.connectInterrupts(controller);
+}
+
+bool Memory::isDmaInProgress() { return clockCounter < dmaEndClock; }
+
+void Memory::mapPages() {
+	for(int i = 0; i < 0x100; i++) readPages[i] = writePages[i] = nullptr;
+	mapRomPages();
+	mapWorkRamPages(!isDmaInProgress());
+}
+
+void Memory::mapRomPages() {
+	for(int i = 0x00; i < 0x80; i++)
+		readPages[i] = isPageWatched(i, Watchpoints::read) ? nullptr : mbc->getRomPage(i << 8);
+}
+
+void Memory::mapWorkRamPages(bool mapped) {
+	workRamMapped = mapped;
+	for(int i = 0xC0; i < 0xFE; i++) {
+		int page = (i - 0xC0) & 0x1F;
+		readPages[i] = mapped && !isPageWatched(i, Watchpoints::read) ? workRam.readPage(page) : nullptr;
+		writePages[i] = mapped && !workRam.isShared(page) && !isPageWatched(i, Watchpoints::write) ? workRam.writePage(page) : nullptr;
+	}
+}
+
+bool Memory::isPageWatched(int page, Watchpoints::Access access) {
+	return watchpoints != nullptr && watchpoints->isPageWatched(page, access);
+}
+
+void Memory::setWatchpoints(Watchpoints* watched) {
+	watchpoints = watched;
+	mapPages();
+}
 
-void Memory::updateJoypad(const Uint8* keystates) { joypad.updateKeystates(keystates); }
-bool Memory::isJoypadInterruptRequested() { return joypad.isInterruptRequested(); }
-void Memory::setJoypadInterruptRequested(byte data) { joypad.setInterruptRequested(data); }
-bool Memory::isTimerInterruptRequested() { return timer.isInterruptRequested();  }
-void Memory::setTimerInterruptRequested(byte data) { timer.setInterruptRequested(data); }
-void Memory::runTimer(int clocks) { timer.run(clocks); }
+// The whole transfer is done up front as one copy. The CPU can't see OAM during the
+// transfer anyway, it only gets locked out of WRAM for the 160 cycles it takes.
+void Memory::startDma(byte source) {
+	const byte* page = readPages[source];
+	if(page != nullptr) {
+		memcpy(lcd->OAM, page, 0xA0);
+	} else {
+		for(int i = 0; i < 0xA0; i++)
+			lcd->OAM[i] = getByte(source << 8 | i);
+	}
+
+	lcd->spriteIndexDirty = true;
+
+	dmaEndClock = clockCounter + 4 + 4 * 160;
+	mapWorkRamPages(false);
+}
+
+void Memory::connectJoypadSource(const std::atomic<byte>* source) { joypad.connectSource(source); }
+void Memory::latchJoypad() { joypad.latch(); }
+bool Memory::wasJoypadPolled() { return joypad.wasPolled(); }
+void Memory::setJoypadKeystates(byte data) { joypad.setKeystates(data); }
+byte Memory::getJoypadKeystates() { return joypad.getKeystates(); }
+uint64_t Memory::getRomHash() { return mbc->getRomHash(); }
+uint64_t Memory::getCartridgeRamHash() { return mbc->getRamHash(); }
+int Memory::getRomBank(word addr) { return mbc->getRomBank(addr); }
+
+APU& Memory::getApu() { return apu; }
+
+void Memory::saveState(std::ostream& out) {
+	writeState(out, clockCounter);
+	workRam.write(out);
+	writeState(out, IOPorts);
+	writeState(out, highRam);
+	joypad.saveState(out);
+	timer->saveState(out);
+	apu.saveState(out);
+	mbc->saveState(out);
+	writeState(out, dmaEndClock);
+}
+
+void Memory::loadState(std::istream& in) {
+	readState(in, clockCounter);
+	workRam.read(in);
+	readState(in, IOPorts);
+	readState(in, highRam);
+	joypad.loadState(in);
+	timer->loadState(in);
+	apu.loadState(in);
+	mbc->loadState(in);
+	readState(in, dmaEndClock);
+	mapPages();
+}
@@ -6,23 +6,79 @@
 #include "defs.hpp"
 #include "lcd.hpp"
 #include "joypad.hpp"
+#include "watchpoints.hpp"
 #include "timer.hpp"
+#include "serial.hpp"
+#include "apu.hpp"
+#include "cow.hpp"
+#include "savefile.hpp"
+#include <cstdint>
+#include <memory>
+#include <vector>
 
 class MBCBase {
 protected:
 	byte romBnkNum;	// Number of ROM banks on chip
 	byte ramSize;	// Number of RAM banks on chip
 
-	byte **rom;		// ROM banks
-	byte **ramExt;	// External RAM banks
+	std::shared_ptr<std::vector<byte>> romData;	// Whole ROM, shared with forks
+	std::vector<byte*> rom;		// ROM banks
+	CowPages ramExt;	// External RAM banks, one after another
+	int ramBanks;		// Number of allocated external RAM banks
+	int ramBankSize;	// Size of each allocated external RAM bank
+
+	SaveFile* save = nullptr;	// Battery backed RAM file, not shared with forks
+
+	// Bounds checked external RAM access
+	byte readRam(int bank, int offset);
+	void writeRam(int bank, int offset, byte data);
+	void allocateRam(int banks, int bankSize);
+
+	uint64_t romHash;	// Hash of the ROM contents
 public:
 	virtual byte getByte(word addr) = 0;
 	virtual void setByte(word addr, byte data) = 0;
 	virtual byte readByte(word addr) = 0;
 	virtual void writeByte(word addr, byte data) = 0;
 
-	MBCBase(const byte *header, std::string filepath);
-	~MBCBase();
+	// Copy that shares ROM and, until written, external RAM with this one
+	virtual MBCBase* fork() = 0;
+	void unshareRam();
+
+	uint64_t getRomHash();
+	uint64_t getRamHash();	// Of the external RAM contents and the clock the save file stored
+
+	// Pointer to the 256 byte page at addr in the currently mapped ROM bank, nullptr if
+	// the access has to go through getByte
+	virtual byte* getRomPage(word addr);
+	int getRomBank(word addr);	// Bank mapped at addr, 0 if it isn't a plain ROM bank
+
+	// Real time clock of MBC3 carts, the others ignore these
+	virtual void connectClock(const unsigned long long*) {}
+	virtual void setRtcHostTime(bool) {}
+	virtual bool getRtcHostTime() { return false; }
+
+	// The clock as stored after the RAM in the save file
+	virtual int rtcSaveSize() { return 0; }
+	virtual void saveRtc(byte*) {}
+	virtual void loadRtc(const byte*) {}
+
+	// Keeps the external RAM (and clock) in the file, loading it if the file is already
+	// there. Returns false if the file can't be used.
+	bool openSave(std::string savepath);
+	// Puts the RAM and clock of the save file back after a state was loaded over them
+	void reloadSave();
+	// Writes the dirty pages if the flush interval passed, or right away with force
+	void flushSave(bool force);
+	void detachSave();
+
+	// Save states; subclasses append their bank registers
+	virtual void saveState(std::ostream& out);
+	virtual void loadState(std::istream& in);
+
+	// romData holds the whole ROM file and becomes the ROM
+	MBCBase(const byte *header, std::shared_ptr<std::vector<byte>> romData);
+	virtual ~MBCBase();
 };
 
 class MBC1 : public MBCBase {
@@ -30,42 +86,54 @@ private:
 	byte romRamRegister; // Select ROM or RAM banks depending on mode
 	bool romRamModeSelect;
 	bool disableExtRam;
+
+	MBC1(const MBC1&) = default;
 public:
-	MBC1(const byte *header, std::string filepath);
-	MBC1(const MBC1&) = delete;
-	~MBC1();
+	MBC1(const byte *header, std::shared_ptr<std::vector<byte>> romData);
+	MBCBase* fork();
 
 	byte getByte(word addr);
 	void setByte(word addr, byte data);
 	byte readByte(word addr);
 	void writeByte(word addr, byte data);
+	byte* getRomPage(word addr);
+
+	void saveState(std::ostream& out);
+	void loadState(std::istream& in);
 };
 
 class MBC2 : public MBCBase {
 private:
 	byte romRegister; // Select ROM bank
 	bool disableExtRam;
+
+	MBC2(const MBC2&) = default;
 public:
-	MBC2(const byte *header, std::string filepath);
-	MBC2(const MBC2&) = delete;
-	~MBC2();
+	MBC2(const byte *header, std::shared_ptr<std::vector<byte>> romData);
+	MBCBase* fork();
 
 	byte getByte(word addr);
 	void setByte(word addr, byte data);
 	byte readByte(word addr);
 	void writeByte(word addr, byte data);
+	byte* getRomPage(word addr);
+
+	void saveState(std::ostream& out);
+	void loadState(std::istream& in);
 };
 
 class MBCROM : public MBCBase {
+private:
+	MBCROM(const MBCROM&) = default;
 public:
-	MBCROM(const byte *header, std::string filepath);
-	MBCROM(const MBCROM&) = delete;
-	~MBCROM();
+	MBCROM(const byte *header, std::shared_ptr<std::vector<byte>> romData);
+	MBCBase* fork();
 
 	byte getByte(word addr);
 	void setByte(word addr, byte data);
 	byte readByte(word addr);
 	void writeByte(word addr, byte data);
+	byte* getRomPage(word addr);
 };
 
 class MBC3 : public MBCBase {
@@ -75,22 +143,54 @@ private:
 	bool disableExtRamAndTimer;
 	byte romBankSelect;
 	byte latchDataRegister;
-	byte rtcRegisters[5];
+	byte rtcRegisters[5];	// Seconds, minutes, hours, day low, day high as last latched
+
+	// The clock doesn't tick, it keeps its value at a base time and works out the
+	// current time from the master clock (or the host clock) when it is latched or set
+	int64_t rtcSeconds;					// Days * 86400 + hours * 3600 + minutes * 60 + seconds at the base
+	unsigned long long rtcBaseClock;	// Master clock at the base
+	int64_t rtcBaseHostTime;			// Host time in seconds since the epoch at the base
+	bool rtcHalted;
+	bool rtcCarry;						// Day counter overflowed
+	bool rtcHostTime;					// Runs on the host clock instead of emulated time
+	const unsigned long long* clock = nullptr;
+
+	int64_t rtcNow();
+	void rebaseRtc(int64_t seconds);
+	void latchRtc();
+	void writeRtc(int reg, byte data);
+
+	MBC3(const MBC3&) = default;
 public:
-	MBC3(const byte *header, std::string filepath);
-	MBC3(const MBC3&) = delete;
-	~MBC3();
+	static const unsigned int clocksPerSecond = 4194304;
+
+	MBC3(const byte *header, std::shared_ptr<std::vector<byte>> romData);
+	MBCBase* fork();
+
+	void connectClock(const unsigned long long*);
+	void setRtcHostTime(bool);
+	bool getRtcHostTime();
+
+	int rtcSaveSize();
+	void saveRtc(byte* out);
+	void loadRtc(const byte* in);
 
 	byte getByte(word addr);
 	void setByte(word addr, byte data);
 	byte readByte(word addr);
 	void writeByte(word addr, byte data);
+	byte* getRomPage(word addr);
+
+	void saveState(std::ostream& out);
+	void loadState(std::istream& in);
 };
 
 class Memory {
+public:
+	unsigned long long clockCounter = 0;	// Master clock, advanced by Board::step
 private:
-	std::string filepath = "";
-	byte cartrigeHeader[0x50];	// Address 0x100 - 0x14F
+	// Touched by nearly every access first, the rest after it
+	unsigned long long dmaEndClock = 0;	// OAM DMA locks WRAM out until the master clock gets here
 
 	// controller class with rom and ram
 	MBCBase* mbc = nullptr;
@@ -98,19 +198,53 @@ private:
 	// VRAM, OAM and LCD registers
 	LCD* lcd = nullptr;
 
+	Timer* timer = nullptr;		// Owned by the Board, next to the CPU
+	Serial* serial = nullptr;	// SB and SC, also owned by the Board
+	InterruptController* interrupts = nullptr;	// IF and IE, also owned by the Board
+
+	// Page table of 256 byte pages for the timed accesses. Plain memory (ROM, WRAM) is
+	// mapped directly, a nullptr sends the access down the slow path through readByteSlow.
+	// WRAM pages shared with a fork are mapped for reading only, pages with watched
+	// addresses not at all.
+	const byte* readPages[0x100];
+	byte* writePages[0x100];
+	bool workRamMapped = false;		// Unmapped during DMA
+
+	Watchpoints* watchpoints = nullptr;	// Checked on the slow path, not shared with forks
+
+	byte IOPorts[0x80] = {};
+	byte highRam[0x80] = {};		// Zeroed so every board starts the same, rollback peers depend on it
+
 	Joypad joypad;
-	Timer timer;
+	APU apu;
+
+	CowPages workRam;
+
+	std::string filepath = "";
+	byte cartrigeHeader[0x50];	// Address 0x100 - 0x14F
 
-	byte workRam[0x2000];
+	void mapPages();
+	void mapRomPages();
+	void mapWorkRamPages(bool);
+	bool isPageWatched(int page, Watchpoints::Access);
+	void startDma(byte);
 
-	byte IOPorts[0x80];
-	byte highRam[0x80];
+	byte readByteSlow(word addr);
+	void writeByteSlow(word addr, byte data);
 
+	Memory(const Memory&) = default;	// Use fork()
 public:
 	// Reads header and instantiates the correct mbc class which reads the complete rom
 	Memory(std::string filepath);
 	~Memory();
 
+	// Copy sharing ROM, WRAM and cartrige RAM pages copy-on-write, constructed at storage
+	// (sizeof(Memory) bytes). The LCD, the timer and the interrupts have to be connected.
+	Memory* fork(void* storage);
+
+	// Takes private copies of all pages still shared with forks
+	void unshare();
+
 	byte getByte(word addr);
 	void setByte(word addr, byte data);
 	byte readByte(word addr);
@@ -122,15 +256,54 @@ public:
 	void writeWord(word addr, word data);
 
 	void connectLCD(LCD* l);
+	void connectTimer(Timer*);
+	void connectSerial(Serial*);
+	void connectInterrupts(InterruptController*);
 	bool isDmaInProgress();
 
 	// joypad 
-	void updateJoypad(const Uint8*);
-	bool isJoypadInterruptRequested();
-	void setJoypadInterruptRequested(byte);
-	bool isTimerInterruptRequested();
-	void setTimerInterruptRequested(byte);
-	void runTimer(int);
+	void connectJoypadSource(const std::atomic<byte>*);
+	void latchJoypad();
+	bool wasJoypadPolled();
+
+	// The MBC3 clock follows emulated time unless set to the host clock
+	void setRtcHostTime(bool);
+	bool getRtcHostTime();
+
+	// Battery backed carts keep their RAM in savepath, by default the ROM path with .sav in
+	// place of the extension. Returns false for carts without a battery or if it fails.
+	bool openSaveFile(std::string savepath = "");
+	void reloadSaveFile();	// See MBCBase::reloadSave
+	void flushSave(bool force);
+
+	// Replaces the host keyboard as the source of joypad input (movies, scripted runs)
+	void setJoypadKeystates(byte);
+	byte getJoypadKeystates();
+
+	// Reads and writes by the CPU of the addresses in it set its trigger. Call again after
+	// changing the addresses, nullptr stops watching.
+	void setWatchpoints(Watchpoints*);
+
+	uint64_t getRomHash();
+	uint64_t getCartridgeRamHash();	// Includes the clock stored in the save file
+	int getRomBank(word addr);	// ROM bank mapped at a cartridge address
+
+	APU& getApu();
+
+	void saveState(std::ostream&);
+	void loadState(std::istream&);
 };
 
+inline byte Memory::readByte(word addr) {
+	const byte* page = readPages[addr >> 8];
+	if(page != nullptr) return page[addr & 0xFF];
+	return readByteSlow(addr);
+}
+
+inline void Memory::writeByte(word addr, byte data) {
+	byte* page = writePages[addr >> 8];
+	if(page != nullptr) page[addr & 0xFF] = data;
+	else writeByteSlow(addr, data);
+}
+
 #endif
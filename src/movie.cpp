@@ -0,0 +1,187 @@
+#include "movie.hpp"
+#include "state.hpp"
+
+#include <fstream>
+#include <sstream>
+
+static const unsigned int movieMagic = 0x564D4247;	// "GBMV"
+static const unsigned int movieVersion = 2;
+
+Movie::Movie() : romHash(0), frames(0), recording(false), lastKeystates(0xFF) {}
+
+Movie::~Movie() {
+	if(recording) stopRecording();
+}
+
+void Movie::startRecording(Board& board, std::string filepath) {
+	this->filepath = filepath;
+	inputs.clear();
+	checkpoints.clear();
+	frames = 0;
+
+	// The recording starts at a frame boundary
+	board.lcd.screenRedrawn = false;
+
+	std::ostringstream state;
+	board.saveState(state);
+	startState = state.str();
+	romHash = board.memory->getRomHash();
+
+	lastKeystates = board.memory->getJoypadKeystates();
+	inputs.push_back({ 0, lastKeystates });
+	recording = true;
+}
+
+void Movie::recordFrame(Board& board, byte keystates) {
+	if(!recording) return;
+	frames++;
+
+	if(frames % checkpointInterval == 0)
+		checkpoints.push_back({ frames, board.lcd.frameHash });
+
+	if(keystates != lastKeystates) {
+		inputs.push_back({ frames, keystates });
+		lastKeystates = keystates;
+	}
+	board.memory->setJoypadKeystates(keystates);
+}
+
+bool Movie::stopRecording() {
+	recording = false;
+	return save(filepath);
+}
+
+bool Movie::isRecording() { return recording; }
+
+bool Movie::save(std::string filepath) {
+	std::ofstream out(filepath, std::ios::binary);
+	if(!out) {
+		std::cerr << "Couldn't write movie: " << filepath << std::endl;
+		return false;
+	}
+
+	writeState(out, movieMagic);
+	writeState(out, movieVersion);
+	writeState(out, romHash);
+	writeState(out, frames);
+
+	unsigned int stateSize = (unsigned int) startState.size();
+	writeState(out, stateSize);
+	out.write(startState.data(), stateSize);
+
+	unsigned int inputCount = (unsigned int) inputs.size();
+	writeState(out, inputCount);
+	for(const InputEvent& e : inputs) {
+		writeState(out, e.frame);
+		writeState(out, e.keystates);
+	}
+
+	unsigned int checkpointCount = (unsigned int) checkpoints.size();
+	writeState(out, checkpointCount);
+	for(const Checkpoint& c : checkpoints) {
+		writeState(out, c.frame);
+		writeState(out, c.hash);
+	}
+	return (bool) out;
+}
+
+// Whether count entries of entrySize bytes are still left in the file, so a corrupt count
+// fails the load instead of allocating gigabytes
+static bool fitsInFile(std::istream& in, std::streamoff fileSize, unsigned int count, size_t entrySize) {
+	std::streamoff position = in.tellg();
+	return in && position >= 0 && (unsigned long long) count * entrySize <= (unsigned long long) (fileSize - position);
+}
+
+bool Movie::load(std::string filepath) {
+	std::ifstream in(filepath, std::ios::binary | std::ios::ate);
+	if(!in) {
+		std::cerr << "Couldn't open movie: " << filepath << std::endl;
+		return false;
+	}
+	std::streamoff fileSize = in.tellg();
+	in.seekg(0);
+
+	unsigned int magic = 0, version = 0;
+	readState(in, magic);
+	readState(in, version);
+	if(magic != movieMagic || version != movieVersion) {
+		std::cerr << "Not a compatible movie file: " << filepath << std::endl;
+		return false;
+	}
+	readState(in, romHash);
+	readState(in, frames);
+
+	unsigned int stateSize = 0;
+	readState(in, stateSize);
+	if(!fitsInFile(in, fileSize, stateSize, 1)) {
+		std::cerr << "Truncated movie file: " << filepath << std::endl;
+		return false;
+	}
+	startState.resize(stateSize);
+	in.read(&startState[0], stateSize);
+
+	unsigned int inputCount = 0;
+	readState(in, inputCount);
+	if(!fitsInFile(in, fileSize, inputCount, sizeof(InputEvent::frame) + sizeof(InputEvent::keystates))) {
+		std::cerr << "Truncated movie file: " << filepath << std::endl;
+		return false;
+	}
+	inputs.resize(inputCount);
+	for(InputEvent& e : inputs) {
+		readState(in, e.frame);
+		readState(in, e.keystates);
+	}
+
+	unsigned int checkpointCount = 0;
+	readState(in, checkpointCount);
+	if(!fitsInFile(in, fileSize, checkpointCount, sizeof(Checkpoint::frame) + sizeof(Checkpoint::hash))) {
+		std::cerr << "Truncated movie file: " << filepath << std::endl;
+		return false;
+	}
+	checkpoints.resize(checkpointCount);
+	for(Checkpoint& c : checkpoints) {
+		readState(in, c.frame);
+		readState(in, c.hash);
+	}
+
+	if(!in) {
+		std::cerr << "Truncated movie file: " << filepath << std::endl;
+		return false;
+	}
+	this->filepath = filepath;
+	return true;
+}
+
+void Movie::applyInputs(Board& board, unsigned int frame, size_t& nextInput) {
+	while(nextInput < inputs.size() && inputs[nextInput].frame <= frame)
+		board.memory->setJoypadKeystates(inputs[nextInput++].keystates);
+}
+
+bool Movie::replay(Board& board) {
+	if(board.memory->getRomHash() != romHash) {
+		std::cerr << "Movie was recorded with a different ROM" << std::endl;
+		return false;
+	}
+	std::istringstream state(startState);
+	if(!board.loadState(state)) return false;
+
+	size_t nextInput = 0;
+	size_t nextCheckpoint = 0;
+	applyInputs(board, 0, nextInput);
+
+	for(unsigned int frame = 1; frame <= frames; frame++) {
+		board.runFrame();
+
+		if(nextCheckpoint < checkpoints.size() && checkpoints[nextCheckpoint].frame == frame) {
+			if(board.lcd.frameHash != checkpoints[nextCheckpoint].hash) {
+				std::cerr << "Movie desynced at frame " << frame << std::endl;
+				return false;
+			}
+			nextCheckpoint++;
+		}
+		applyInputs(board, frame, nextInput);
+	}
+	return true;
+}
+
+unsigned int Movie::getFrameCount() { return frames; }
@@ -0,0 +1,57 @@
+#ifndef MOVIE_HPP
+#define MOVIE_HPP
+
+#include "defs.hpp"
+#include "board.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Joypad input movie: the start state, the ROM hash, the joypad bitmask for every
+// frame where it changed and periodic frame hashes to detect desyncs on replay.
+class Movie {
+private:
+	struct InputEvent {
+		unsigned int frame;		// Applied before this frame is emulated
+		byte keystates;
+	};
+	struct Checkpoint {
+		unsigned int frame;		// Hash of the screen after this many frames
+		uint64_t hash;
+	};
+
+	uint64_t romHash;
+	std::string startState;
+	std::vector<InputEvent> inputs;
+	std::vector<Checkpoint> checkpoints;
+	unsigned int frames;
+
+	std::string filepath;
+	bool recording;
+	byte lastKeystates;
+
+	void applyInputs(Board&, unsigned int frame, size_t& nextInput);
+
+public:
+	static const unsigned int checkpointInterval = 60;
+
+	Movie();
+	~Movie();
+
+	// Recording
+	void startRecording(Board&, std::string filepath);
+	void recordFrame(Board&, byte keystates);
+	bool stopRecording();
+	bool isRecording();
+
+	bool save(std::string filepath);
+	bool load(std::string filepath);
+
+	// Runs the whole movie headless and uncapped, stops at the first desync
+	bool replay(Board&);
+
+	unsigned int getFrameCount();
+};
+
+#endif
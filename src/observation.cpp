@@ -0,0 +1,147 @@
+#include "observation.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Rounds up like _mm_avg_epu8 so both paths give the same bytes
+static inline byte average(byte a, byte b) { return (a + b + 1) >> 1; }
+
+// Shades 0 - 3 to gray levels 0 - 255
+static void scaleRow(const byte* in, byte* out, int width) {
+	int x = 0;
+#ifdef __SSE2__
+	for(; x + 16 <= width; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+		// v * 85 as v * 64 + v * 16 + v * 4 + v, nothing carries into the next byte for v <= 3
+		__m128i high = _mm_add_epi8(_mm_slli_epi16(v, 6), _mm_slli_epi16(v, 4));
+		__m128i low = _mm_add_epi8(_mm_slli_epi16(v, 2), v);
+		_mm_storeu_si128((__m128i*)(out + x), _mm_add_epi8(high, low));
+	}
+#endif
+	for(; x < width; x++) out[x] = in[x] * 85;
+}
+
+static void averageRows(const byte* a, const byte* b, byte* out, int width) {
+	int x = 0;
+#ifdef __SSE2__
+	for(; x + 16 <= width; x += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+		_mm_storeu_si128((__m128i*)(out + x), _mm_avg_epu8(va, vb));
+	}
+#endif
+	for(; x < width; x++) out[x] = average(a[x], b[x]);
+}
+
+// Halves a row, width is the width of the result
+static void averagePairs(const byte* in, byte* out, int width) {
+	int x = 0;
+#ifdef __SSE2__
+	const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+	for(; x + 16 <= width; x += 16) {
+		__m128i v0 = _mm_loadu_si128((const __m128i*)(in + 2 * x));
+		__m128i v1 = _mm_loadu_si128((const __m128i*)(in + 2 * x + 16));
+		__m128i avg0 = _mm_avg_epu16(_mm_and_si128(v0, lowBytes), _mm_srli_epi16(v0, 8));
+		__m128i avg1 = _mm_avg_epu16(_mm_and_si128(v1, lowBytes), _mm_srli_epi16(v1, 8));
+		_mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(avg0, avg1));
+	}
+#endif
+	for(const byte* pair = in + 2 * x; x < width; x++, pair += 2) out[x] = average(pair[0], pair[1]);
+}
+
+// Four shades per byte, width is a multiple of 4 for every downsample
+static void packRow(const byte* in, byte* out, int width) {
+	assert(width % 4 == 0);
+	for(int x = 0; x + 4 <= width; x += 4)
+		out[x / 4] = in[x] << 6 | in[x + 1] << 4 | in[x + 2] << 2 | in[x + 3];
+}
+
+Observer::Observer(int downsample, bool packed, int stack)
+	: downsample(downsample), packed(packed), stack(stack), ring(nullptr), slots(0), slotStride(0), slot(-1) {
+	if(downsample != 1 && downsample != 2 && downsample != 4) throw std::invalid_argument("Downsample must be 1, 2 or 4");
+	if(stack < 1) throw std::invalid_argument("Observations need at least one frame");
+}
+
+int Observer::width() { return 0xA0 / downsample; }
+int Observer::height() { return 0x90 / downsample; }
+int Observer::frameSize() { return (packed ? width() / 4 : width()) * height(); }
+int Observer::observationSize() { return frameSize() * stack; }
+
+void Observer::setRing(byte* ring, int slots, size_t slotStride) {
+	this->ring = ring;
+	this->slots = slots;
+	this->slotStride = slotStride != 0 ? slotStride : observationSize();
+	slot = -1;
+}
+
+int Observer::latestSlot() { return slot; }
+byte* Observer::observation(int slot) { return ring + slot * slotStride; }
+
+void Observer::rewind() { slot = -1; }
+
+// Gray levels are averaged, so a 2x2 block of black and white comes out gray. Packed
+// frames average the shades themselves to stay within 2 bits.
+void Observer::downsampleFrame(const byte screen[0x90][0xA0], byte* out) {
+	byte rows[4][0xA0];
+	int rowBytes = packed ? width() / 4 : width();
+
+	for(int y = 0; y < height(); y++) {
+		const byte* source[4] = {};
+		for(int i = 0; i < downsample; i++) {
+			if(packed) source[i] = screen[y * downsample + i];
+			else {
+				scaleRow(screen[y * downsample + i], rows[i], 0xA0);
+				source[i] = rows[i];
+			}
+		}
+
+		const byte* row = source[0];
+		if(downsample == 2) {
+			averageRows(source[0], source[1], rows[0], 0xA0);
+			averagePairs(rows[0], rows[1], 0x50);
+			row = rows[1];
+		} else if(downsample == 4) {
+			averageRows(source[0], source[1], rows[0], 0xA0);
+			averageRows(source[2], source[3], rows[1], 0xA0);
+			averageRows(rows[0], rows[1], rows[0], 0xA0);
+			averagePairs(rows[0], rows[1], 0x50);
+			averagePairs(rows[1], rows[0], 0x28);
+			row = rows[0];
+		}
+
+		if(packed) packRow(row, out + y * rowBytes, width());
+		else memcpy(out + y * rowBytes, row, rowBytes);
+	}
+}
+
+void Observer::capture(const byte screen[0x90][0xA0]) {
+	if(ring == nullptr) return;
+	if(slot < 0) {
+		restart(screen);
+		return;
+	}
+
+	int frame = frameSize();
+	byte* previous = observation(slot);
+	slot = (slot + 1) % slots;
+	byte* current = observation(slot);
+
+	if(stack > 1) memmove(current, previous + frame, (stack - 1) * frame);
+	downsampleFrame(screen, current + (stack - 1) * frame);
+}
+
+void Observer::restart(const byte screen[0x90][0xA0]) {
+	if(ring == nullptr) return;
+	if(slot < 0) slot = 0;
+
+	int frame = frameSize();
+	byte* current = observation(slot);
+	byte* newest = current + (stack - 1) * frame;
+	downsampleFrame(screen, newest);
+	for(int i = 0; i < stack - 1; i++) memcpy(current + i * frame, newest, frame);
+}
@@ -0,0 +1,46 @@
+#ifndef OBSERVATION_HPP
+#define OBSERVATION_HPP
+
+#include "defs.hpp"
+#include <cstddef>
+
+// Turns completed frames into observations for agents, written straight into a ring of
+// buffers the caller owns. A frame is shrunk by 1, 2 or 4 in both directions, either to
+// grayscale bytes (0 black - 255 white) or packed 4 pixels per byte as 2-bit shades
+// (leftmost pixel in the high bits). An observation is the last stack frames, oldest first.
+class Observer {
+private:
+	int downsample;
+	bool packed;
+	int stack;
+
+	byte* ring;
+	int slots;
+	size_t slotStride;		// Bytes from one slot to the next
+	int slot;				// Slot of the latest observation, -1 before the first
+
+	void downsampleFrame(const byte screen[0x90][0xA0], byte* out);
+public:
+	Observer(int downsample = 2, bool packed = false, int stack = 1);
+
+	int width();
+	int height();
+	int frameSize();			// Bytes per frame
+	int observationSize();		// Bytes per slot, stack frames
+
+	// ring holds slots observations slotStride bytes apart, 0 packs them back to back
+	void setRing(byte* ring, int slots, size_t slotStride = 0);
+
+	// Called by the LCD when a frame is complete. Writes the next slot from the frames
+	// of the latest one and the new frame.
+	void capture(const byte screen[0x90][0xA0]);
+
+	// Starts over: the latest slot (slot 0 after rewind) gets the frame in every stack position
+	void restart(const byte screen[0x90][0xA0]);
+	void rewind();
+
+	int latestSlot();
+	byte* observation(int slot);
+};
+
+#endif
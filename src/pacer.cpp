@@ -0,0 +1,81 @@
+#include "pacer.hpp"
+
+#include <algorithm>
+#include <thread>
+
+static const std::chrono::microseconds minSpinWindow = std::chrono::microseconds(100);
+static const std::chrono::microseconds maxSpinWindow = std::chrono::microseconds(2000);
+
+FramePacer::FramePacer(std::chrono::nanoseconds period) : 
+	period(period), vsync(false), overshoot(0), spinWindow(std::chrono::microseconds(300)),
+	frameTimes(historySize, 0), frameTimeIndex(0), frames(0), late(0) {
+	start();
+}
+
+void FramePacer::start() {
+	lastFrame = Clock::now();
+	nextFrame = lastFrame + period;
+}
+
+void FramePacer::waitForNextFrame() {
+	if(vsync) {
+		// SDL_RenderPresent already waited for the display
+		recordFrame(Clock::now());
+		return;
+	}
+
+	Clock::time_point now = Clock::now();
+	if(now > nextFrame) {
+		late++;
+		// Don't try to catch up on frames that are already lost
+		if(now - nextFrame > period) nextFrame = now;
+	} else {
+		// Coarse sleep
+		Clock::time_point wakeUp = nextFrame - spinWindow;
+		if(now < wakeUp) {
+			std::this_thread::sleep_until(wakeUp);
+			now = Clock::now();
+			long long over = std::chrono::duration_cast<std::chrono::nanoseconds>(now - wakeUp).count();
+			overshoot = overshoot * 0.9 + over * 0.1;
+
+			// Spin for twice the typical overshoot
+			std::chrono::nanoseconds window = std::chrono::nanoseconds((long long) (overshoot * 2));
+			spinWindow = std::max<Clock::duration>(minSpinWindow, std::min<Clock::duration>(maxSpinWindow, window));
+		}
+
+		// Spin-yield the rest
+		while(Clock::now() < nextFrame)
+			std::this_thread::yield();
+	}
+
+	recordFrame(Clock::now());
+	nextFrame += period;
+}
+
+void FramePacer::recordFrame(Clock::time_point now) {
+	frameTimes[frameTimeIndex] = std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastFrame).count();
+	frameTimeIndex = (frameTimeIndex + 1) % historySize;
+	lastFrame = now;
+	frames++;
+}
+
+void FramePacer::setVsync(bool enable) { vsync = enable; }
+bool FramePacer::isVsync() { return vsync; }
+
+FramePacer::Stats FramePacer::getStats() {
+	Stats stats;
+	stats.frames = frames;
+	stats.late = late;
+	stats.spinWindow = std::chrono::duration_cast<std::chrono::nanoseconds>(spinWindow).count() / 1000.0;
+
+	size_t count = (size_t) std::min<unsigned long long>(frames, historySize);
+	if(count == 0) {
+		stats.p50 = stats.p99 = 0;
+		return stats;
+	}
+	std::vector<long long> sorted(frameTimes.begin(), frameTimes.begin() + count);
+	std::sort(sorted.begin(), sorted.end());
+	stats.p50 = sorted[count / 2] / 1e6;
+	stats.p99 = sorted[std::min(count - 1, count * 99 / 100)] / 1e6;
+	return stats;
+}
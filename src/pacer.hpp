@@ -0,0 +1,52 @@
+#ifndef PACER_HPP
+#define PACER_HPP
+
+#include <chrono>
+#include <vector>
+
+// Paces frames on the monotonic clock. Sleeps coarsely and spin-yields the last part of
+// the wait; the spin window adapts to how much the OS overshoots the sleeps.
+class FramePacer {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Stats {
+		unsigned long long frames;	// Frames paced since start
+		unsigned long long late;	// Frames that missed their deadline
+		double p50;					// Frame time percentiles over the last frames in ms
+		double p99;
+		double spinWindow;			// Current spin window in µs
+	};
+
+private:
+	Clock::duration period;
+	Clock::time_point nextFrame;
+	Clock::time_point lastFrame;
+	bool vsync;
+
+	double overshoot;	// Moving average of the sleep overshoot in ns
+	Clock::duration spinWindow;
+
+	std::vector<long long> frameTimes;	// Ring of the last frame times in ns
+	size_t frameTimeIndex;
+	unsigned long long frames;
+	unsigned long long late;
+
+	void recordFrame(Clock::time_point);
+public:
+	static const size_t historySize = 1024;
+
+	FramePacer(std::chrono::nanoseconds period);
+
+	void start();
+
+	// Blocks until the next frame is due; with vsync the presenter blocks instead
+	void waitForNextFrame();
+
+	void setVsync(bool);
+	bool isVsync();
+
+	Stats getStats();
+};
+
+#endif
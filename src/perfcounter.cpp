@@ -0,0 +1,53 @@
+#include "perfcounter.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+
+CacheMissCounter::CacheMissCounter() {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+CacheMissCounter::~CacheMissCounter() {
+	if(fd >= 0) close(fd);
+}
+
+bool CacheMissCounter::isAvailable() { return fd >= 0; }
+
+void CacheMissCounter::start() {
+	if(fd < 0) return;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+void CacheMissCounter::stop() {
+	if(fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+}
+
+long long CacheMissCounter::read() {
+	long long count;
+	if(fd < 0 || ::read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+	return count;
+}
+
+#else
+
+CacheMissCounter::CacheMissCounter() : fd(-1) {}
+CacheMissCounter::~CacheMissCounter() {}
+bool CacheMissCounter::isAvailable() { return false; }
+void CacheMissCounter::start() {}
+void CacheMissCounter::stop() {}
+long long CacheMissCounter::read() { return -1; }
+
+#endif
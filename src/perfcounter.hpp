@@ -0,0 +1,20 @@
+#ifndef PERFCOUNTER_HPP
+#define PERFCOUNTER_HPP
+
+// L1 data cache read misses of the calling thread, from the kernel's perf events. Not
+// available outside Linux or when the kernel doesn't allow it; read() returns -1 then.
+class CacheMissCounter {
+private:
+	int fd;
+public:
+	CacheMissCounter();
+	CacheMissCounter(const CacheMissCounter&) = delete;
+	~CacheMissCounter();
+
+	bool isAvailable();
+	void start();
+	void stop();
+	long long read();
+};
+
+#endif
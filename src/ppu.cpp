@@ -0,0 +1,235 @@
+#include "ppu.hpp"
+#include "lcd.hpp"
+#include "state.hpp"
+
+// --------------------------------- TileCache member functions ----------------------------------
+
+TileCache::TileCache() {
+	invalidateAll();
+}
+
+void TileCache::decode(const byte* vram, int tile) {
+	for(int row = 0; row < 8; row++) {
+		byte upperTileByte = vram[tile * 16 + 2 * row + 0];
+		byte lowerTileByte = vram[tile * 16 + 2 * row + 1];
+		for(int j = 0; j < 8; j++)
+			rows[tile][row][j] = ((upperTileByte >> (7 - j)) & 1) << 1 | ((lowerTileByte >> (7 - j)) & 1);
+	}
+	dirty[tile] = false;
+}
+
+void TileCache::invalidate(word vramOffset) {
+	if(vramOffset < 0x1800) dirty[vramOffset >> 4] = true;
+}
+
+void TileCache::invalidateAll() {
+	for(int i = 0; i < 384; i++) dirty[i] = true;
+}
+
+// --------------------------------- ScanlinePPU member functions --------------------------------
+
+ScanlinePPU::ScanlinePPU() : clocksInMode3(0) {}
+
+void ScanlinePPU::beginLine(LCD&) {
+	clocksInMode3 = 0;
+}
+
+bool ScanlinePPU::run(LCD& lcd, int clocks) {
+	clocksInMode3 += clocks;
+	if(clocksInMode3 < mode3Length) return false;
+	if(!lcd.renderingEnabled) return true;
+
+	lcd.renderBackgroundLine();
+	lcd.renderWindowLine();
+	lcd.renderSpritesLine();
+	return true;
+}
+
+void ScanlinePPU::saveState(std::ostream& out) {
+	writeState(out, clocksInMode3);
+}
+
+void ScanlinePPU::loadState(std::istream& in) {
+	readState(in, clocksInMode3);
+}
+
+// --------------------------------- FifoPPU member functions ------------------------------------
+
+FifoPPU::FifoPPU() {
+	dots = 0;
+	fetchDots = 0;
+	fetchTileX = 0;
+	fetchTileNum = 0;
+	fetchingWindow = false;
+	bgHead = bgCount = 0;
+	for(int i = 0; i < 8; i++) bgFifo[i] = spriteColor[i] = spriteAttribs[i] = spriteNum[i] = 0;
+	for(int i = 0; i < 10; i++) spriteFetched[i] = false;
+	spriteStall = 0;
+	x = 0;
+	discard = 0;
+}
+
+void FifoPPU::beginLine(LCD& lcd) {
+	dots = 0;
+	fetchDots = -6;		// The first fetch of a line is thrown away
+	fetchTileX = 0;
+	fetchingWindow = false;
+	bgHead = bgCount = 0;
+	for(int i = 0; i < 8; i++) spriteColor[i] = 0;
+	for(int i = 0; i < 10; i++) spriteFetched[i] = false;
+	spriteStall = 0;
+	x = 0;
+	discard = lcd.SCXreg % 8;
+	if(lcd.spriteIndexDirty) lcd.buildSpriteIndex();
+}
+
+bool FifoPPU::run(LCD& lcd, int clocks) {
+	for(int i = 0; i < clocks; i++) {
+		dots++;
+		if(spriteStall > 0) { spriteStall--; continue; }
+		if(discard == 0 && fetchSprites(lcd)) continue;
+
+		stepFetcher(lcd);
+		if(bgCount == 0) continue;
+
+		// Starting the window restarts the fetcher on the window tile map
+		if(!fetchingWindow && (lcd.LCDCreg & 0x20) != 0 && lcd.LYreg >= lcd.WYreg && discard == 0 && x + 7 == lcd.WXreg) {
+			fetchingWindow = true;
+			fetchTileX = 0;
+			fetchDots = 0;
+			bgCount = 0;
+			continue;
+		}
+
+		byte colorNum = bgFifo[bgHead++];
+		bgCount--;
+		if(discard > 0) { discard--; continue; }
+
+		outputPixel(lcd, colorNum);
+		if(x == 0xA0) return true;
+	}
+	return false;
+}
+
+// Tile number, then the two data bytes, two dots each. The row goes into the FIFO once it's empty.
+void FifoPPU::stepFetcher(LCD& lcd) {
+	byte mapY = fetchingWindow ? lcd.LYreg - lcd.WYreg : lcd.SCYreg + lcd.LYreg;
+
+	if(fetchDots < 6) {
+		fetchDots++;
+		if(fetchDots == 2) {
+			bool highMap = (lcd.LCDCreg & (fetchingWindow ? 0x40 : 0x08)) != 0;
+			byte tileX = fetchingWindow ? fetchTileX : ((lcd.SCXreg >> 3) + fetchTileX) & 0x1F;
+			fetchTileNum = lcd.VRAM[(highMap ? 0x1C00 : 0x1800) + (mapY / 8) * 32 + tileX];
+		}
+		return;
+	}
+
+	if(bgCount == 0) {
+		const byte* colorNums = lcd.tileCache.row(lcd.VRAM, lcd.bgTileIndex(fetchTileNum), mapY % 8);
+		for(int i = 0; i < 8; i++) bgFifo[i] = colorNums[i];
+		bgHead = 0;
+		bgCount = 8;
+		fetchTileX = (fetchTileX + 1) & 0x1F;
+		fetchDots = 0;
+	}
+}
+
+// Fetches the next sprite starting at the current pixel into the sprite FIFO, stalling the line
+bool FifoPPU::fetchSprites(LCD& lcd) {
+	if((lcd.LCDCreg & 0x02) == 0 || lcd.LYreg >= 0x90) return false;
+
+	byte line = lcd.LYreg;
+	for(int i = 0; i < lcd.spriteCountOnLine[line]; i++) {
+		if(spriteFetched[i]) continue;
+
+		byte num = lcd.spritesOnLine[line][i];
+		int left = lcd.OAM[num * 4 + 1] - 8;
+		if(left > x) continue;
+		spriteFetched[i] = true;
+		if(left + 8 <= x) continue;		// Entirely off the left edge
+
+		byte attribs = lcd.OAM[num * 4 + 3];
+		bool flipX = (attribs & 0x20) != 0;
+		const byte* colorNums = lcd.spriteRow(num);
+
+		// Earlier sprites keep their pixels, only transparent slots are filled
+		for(int j = 0; j < 8; j++) {
+			int slot = left + j - x;
+			if(slot < 0) continue;
+			byte colorNum = colorNums[flipX ? 7 - j : j];
+			if(spriteColor[slot] == 0 && colorNum != 0) {
+				spriteColor[slot] = colorNum;
+				spriteAttribs[slot] = attribs;
+				spriteNum[slot] = num;
+			}
+		}
+
+		spriteStall = spriteFetchDots - 1;
+		return true;
+	}
+	return false;
+}
+
+// Mixes the sprite FIFO in and writes the pixel with the palettes as they are right now
+void FifoPPU::outputPixel(LCD& lcd, byte colorNum) {
+	bool bgVisible = fetchingWindow || (lcd.LCDCreg & 0x01) != 0;
+	byte source = bgVisible ? colorNum : 0;
+	byte shade = bgVisible ? 3 - ((lcd.BGPreg >> colorNum * 2) & 0x03) : 0;
+
+	if(spriteColor[0] != 0 && (lcd.LCDCreg & 0x02) != 0) {
+		bool behindBG = (spriteAttribs[0] & 0x80) != 0;
+		if(!behindBG || source == 0) {
+			byte paletteReg = (spriteAttribs[0] & 0x10) == 0 ? lcd.OBP0reg : lcd.OBP1reg;
+			shade = 3 - ((paletteReg >> spriteColor[0] * 2) & 0x03);
+			source = spriteNum[0] + 4;
+		}
+	}
+
+	lcd.screen[lcd.LYreg][x] = shade;
+	lcd.screenSourceData[lcd.LYreg][x] = source;
+
+	for(int i = 0; i < 7; i++) {
+		spriteColor[i] = spriteColor[i + 1];
+		spriteAttribs[i] = spriteAttribs[i + 1];
+		spriteNum[i] = spriteNum[i + 1];
+	}
+	spriteColor[7] = 0;
+	x++;
+}
+
+void FifoPPU::saveState(std::ostream& out) {
+	writeState(out, dots);
+	writeState(out, fetchDots);
+	writeState(out, fetchTileX);
+	writeState(out, fetchTileNum);
+	writeState(out, fetchingWindow);
+	writeState(out, bgFifo);
+	writeState(out, bgHead);
+	writeState(out, bgCount);
+	writeState(out, spriteColor);
+	writeState(out, spriteAttribs);
+	writeState(out, spriteNum);
+	writeState(out, spriteFetched);
+	writeState(out, spriteStall);
+	writeState(out, x);
+	writeState(out, discard);
+}
+
+void FifoPPU::loadState(std::istream& in) {
+	readState(in, dots);
+	readState(in, fetchDots);
+	readState(in, fetchTileX);
+	readState(in, fetchTileNum);
+	readState(in, fetchingWindow);
+	readState(in, bgFifo);
+	readState(in, bgHead);
+	readState(in, bgCount);
+	readState(in, spriteColor);
+	readState(in, spriteAttribs);
+	readState(in, spriteNum);
+	readState(in, spriteFetched);
+	readState(in, spriteStall);
+	readState(in, x);
+	readState(in, discard);
+}
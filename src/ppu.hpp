@@ -0,0 +1,102 @@
+#ifndef PPU_HPP
+#define PPU_HPP
+
+#include <iostream>
+#include "defs.hpp"
+
+class LCD;
+
+// Tiles of VRAM decoded to color numbers, redecoded lazily after a write to the tile
+class TileCache {
+private:
+	byte rows[384][8][8];
+	bool dirty[384];
+
+	void decode(const byte* vram, int tile);
+public:
+	TileCache();
+
+	void invalidate(word vramOffset);
+	void invalidateAll();
+
+	// 8 color numbers of a tile row, tile is 0 - 383 counted from 0x8000
+	const byte* row(const byte* vram, int tile, int row) {
+		if(dirty[tile]) decode(vram, tile);
+		return rows[tile][row];
+	}
+};
+
+// Draws the pixels of a visible line during mode 3
+class PPUEngine {
+public:
+	virtual ~PPUEngine() {}
+
+	// Called when the line enters mode 3
+	virtual void beginLine(LCD&) = 0;
+
+	// Advances mode 3 by the clocks, returns true once all pixels of the line are out
+	virtual bool run(LCD&, int clocks) = 0;
+
+	virtual void saveState(std::ostream&) = 0;
+	virtual void loadState(std::istream&) = 0;
+};
+
+// Renders the whole line at once at the end of a fixed length mode 3
+class ScanlinePPU : public PPUEngine {
+private:
+	int clocksInMode3;
+public:
+	static const int mode3Length = 92;
+
+	ScanlinePPU();
+
+	void beginLine(LCD&);
+	bool run(LCD&, int clocks);
+
+	void saveState(std::ostream&);
+	void loadState(std::istream&);
+};
+
+// Dot by dot pixel FIFO. Registers are read when the hardware reads them, so mid line
+// SCX, palette and window changes show up and mode 3 gets longer for fine scroll,
+// the window and every sprite fetched.
+class FifoPPU : public PPUEngine {
+private:
+	int dots;
+
+	// Background/window fetcher
+	int fetchDots;			// Dots into the current fetch, negative during the discarded first fetch
+	byte fetchTileX;
+	byte fetchTileNum;
+	bool fetchingWindow;
+
+	byte bgFifo[8];
+	int bgHead;
+	int bgCount;
+
+	// Sprite pixels lined up with the next output pixel
+	byte spriteColor[8];	// Color number, 0 is transparent
+	byte spriteAttribs[8];
+	byte spriteNum[8];
+	bool spriteFetched[10];
+	int spriteStall;
+
+	byte x;					// Next screen pixel
+	int discard;			// Pixels dropped for fine SCX
+
+	void stepFetcher(LCD&);
+	bool fetchSprites(LCD&);
+	void outputPixel(LCD&, byte colorNum);
+public:
+	static const int spriteFetchDots = 6;
+
+	FifoPPU();
+
+	void beginLine(LCD&);
+	bool run(LCD&, int clocks);
+
+	void saveState(std::ostream&);
+	void loadState(std::istream&);
+};
+
+#endif
@@ -1,15 +1,21 @@
 #include "render.hpp"
-#include <ctime>
 
 Uint32 Render::pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
 Uint32 Render::vramTiles[16 * 8 * 24 * 8];
 Uint32 Render::backgroundTiles[32 * 8 * 32 * 8];
 
-Render::Render() : board("..\\..\\ROM\\Super Mario Land 2 - 6 Golden Coins (UE) (V1.2) [!].gb") {
+// Duration of one LCD frame: 70224 clocks at 4194304 Hz
+static const std::chrono::nanoseconds framePeriod = std::chrono::nanoseconds(16742706);
+
+Render::Render() : board("..\\..\\ROM\\Super Mario Land 2 - 6 Golden Coins (UE) (V1.2) [!].gb"), pacer(framePeriod) {
 	if(board.memory != nullptr && init()) mainLoop();
 }
 
-Render::Render(std::string filepath) : board(filepath) {
+Render::Render(std::string filepath) : board(filepath), pacer(framePeriod) {
+	if(board.memory != nullptr && init()) mainLoop();
+}
+
+Render::Render(std::string filepath, RenderOptions options) : board(filepath), options(options), pacer(framePeriod) {
 	if(board.memory != nullptr && init()) mainLoop();
 }
 
@@ -18,7 +24,6 @@ Render::~Render() {
 }
 
 void Render::mainLoop() {
-	SDL_Event e;
 	bool shouldQuit = false;
 	//board.mbc1.readRom("..\\..\\ROM\\Super Mario Land 2 - 6 Golden Coins (UE) (V1.2) [!].gb");
 	//board.memory.readRom("..\\..\\ROM\\Kirby's Dream Land (U) [!].gb");
@@ -28,52 +33,52 @@ void Render::mainLoop() {
 	//board.mbc1.readRom("..\\..\\ROM\\Tests\\cpu_instrs\\cpu_instrs.gb");
 	//board.mbc1.readRom("..\\..\\ROM\\Tests\\cpu_instrs\\individual\\06-ld r,r.gb");
 
-	// Timing
-	std::chrono::nanoseconds lcd = std::chrono::nanoseconds(16742706);
-	std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
-	std::chrono::system_clock::time_point oldTime = std::chrono::system_clock::now();
-	std::chrono::system_clock::time_point newTime = std::chrono::system_clock::now();
-
-	
-	while(!shouldQuit) {
-		while(SDL_PollEvent(&e) != 0)
-			if(e.type == SDL_QUIT) shouldQuit = true;
-
-		const Uint8* currentKeyStates = SDL_GetKeyboardState(NULL);
-		if(currentKeyStates[SDL_SCANCODE_ESCAPE]) shouldQuit = true;
-
-		board.memory->updateJoypad(currentKeyStates);
+	board.lcd.setFifoPPU(options.fifoPPU);
+	board.memory->setRtcHostTime(options.rtcHostTime);
+	board.memory->openSaveFile();
+	if(options.bootCache) BootCache(BootCache::defaultDirectory(), options.bootPoint, options.bootFrames).restore(board);
 
-		newTime = std::chrono::system_clock::now();
-
-		board.step();
-
-		if(board.lcd.screenRedrawn) {
-			auto deltaT = std::chrono::duration_cast<std::chrono::nanoseconds>(newTime - oldTime);
-
-			static int i = 0;
-			i++;
-			if(i > 60) i = 0;
-
-			if(i == 0) {
-				std::cout << "Frame duration: " << deltaT.count() << std::endl;
-			}
-
-			board.lcd.screenRedrawn = false;
-			render(board.lcd.screen);
-			std::this_thread::sleep_until(oldTime + lcd);
-			oldTime = newTime;
+	// Movies set the joypad themselves so replays stay deterministic
+	if(!options.movieFilepath.empty()) movie.startRecording(board, options.movieFilepath);
+	else board.setInputSource(input.getSource());
 
+	if(options.runAheadFrames > 0) {
+		runAhead = new RunAhead(options.runAheadFrames, options.runAheadSecondInstance ? RunAhead::secondInstance : RunAhead::fork);
+		runAhead->setDrawBoard(movie.isRecording());	// The movie checks the board's frame hashes
+	}
 
-			auto deltaTSleep = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now() - oldTime);
-			if(i == 0) {
-				std::cout << "Sleep duration: " << deltaTSleep.count() << std::endl;
-				std::cout << "Sleep percentage: " << ((double) deltaTSleep.count() / deltaT.count() * 100) << std::endl << std::endl;
-			}
-		}
+	pacer.setVsync(options.vsync);
+	pacer.start();
 	
+	while(!shouldQuit) {
+		if(audioSync != nullptr) board.memory->getApu().setRateAdjustment(audioSync->update());
+		const LCD* shown = &board.lcd;
+		if(runAhead != nullptr) shown = &runAhead->runFrame(board);
+		else board.runFrame();
+
+		// Host input is sampled once per frame, the joypad latches it when the next one starts
+		input.sample();
+		if(input.isQuitRequested()) shouldQuit = true;
+		movie.recordFrame(board, input.getKeystates());
+
+		board.lcd.screenRedrawn = false;
+		render(*shown);
+		if(audioSync != nullptr) audioSync->wait();
+		else pacer.waitForNextFrame();
+	}
+
+	if(movie.isRecording()) movie.stopRecording();
 
+	if(runAhead != nullptr) {
+		std::cout << "Run-ahead: " << runAhead->getFrames() << " frames, " << runAhead->overheadMsPerFrame() << " ms per frame" << std::endl;
+		delete runAhead;
+		runAhead = nullptr;
+	}
 
+	if(audioSync != nullptr) {
+		AudioSync::Stats stats = audioSync->getStats();
+		std::cout << "Audio sync: latency " << stats.latency << " ms (target " << stats.targetLatency << " ms), "
+			<< stats.underruns << " underruns" << std::endl;
 	}
 }
 
@@ -93,6 +98,28 @@ void Render::render(const byte lcd[SCREEN_HEIGHT][SCREEN_WIDTH]) {
 	SDL_RenderPresent(renderer);
 }
 
+// Only converts and uploads the lines that changed since the last frame
+void Render::render(const LCD& lcd) {
+	int firstLine = SCREEN_HEIGHT, lastLine = -1;
+	for(int i = 0; i < SCREEN_HEIGHT; i++) {
+		if(screenTextureValid && !lcd.isLineDirty(i)) continue;
+		for(int j = 0; j < SCREEN_WIDTH; j++)
+			pixels[i*SCREEN_WIDTH + j] = 0xFFFFFF / 3 * lcd.screen[i][j];
+		if(firstLine > i) firstLine = i;
+		lastLine = i;
+	}
+
+	if(lastLine >= firstLine) {
+		SDL_Rect rect = { 0, firstLine, SCREEN_WIDTH, lastLine - firstLine + 1 };
+		SDL_UpdateTexture(screenTexture, &rect, pixels + firstLine * SCREEN_WIDTH, SCREEN_WIDTH * sizeof(Uint32));
+	}
+	screenTextureValid = true;
+
+	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0x00, 0xFF);
+	SDL_RenderClear(renderer);
+	SDL_RenderCopy(renderer, screenTexture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+}
 void Render::renderTiles(const byte tiles[24 * 8][16 * 8]) {
 	for(int i = 0; i < 24 * 8; i++) {
 		for(int j = 0; j < 16 * 8; j++) {
@@ -135,7 +162,7 @@ bool Render::init() {
 		std::cout << "Couldn't create window: " << SDL_GetError() << std::endl;
 		return false;
 	} 
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (options.vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 	if(renderer == NULL) {
 		std::cout << "Couldn't create renderer: " << SDL_GetError() << std::endl;
 		return false;
@@ -156,12 +183,27 @@ bool Render::init() {
 		return false;
 	}
 	SDL_SetWindowResizable(window, SDL_TRUE);
+
+	if(options.audio) {
+		audio = new SDLAudioSink(options.sampleRate);
+		if(audio->isOpen()) {
+			board.setAudioSink(audio, options.sampleRate);
+			if(options.audioSync) audioSync = new AudioSync(audio, options.audioLatency);
+		}
+	}
 	return true;
 }
 
 
 
 void Render::close() {
+	delete audioSync;
+	audioSync = nullptr;
+	if(audio != nullptr) {
+		if(board.memory != nullptr) board.setAudioSink(nullptr, options.sampleRate);
+		delete audio;
+		audio = nullptr;
+	}
 	SDL_DestroyTexture(backgorundTilesTexture);
 	SDL_DestroyTexture(vramTilesTexture);
 	SDL_DestroyTexture(screenTexture);
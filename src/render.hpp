@@ -5,14 +5,34 @@
 #include <iostream>
 #include "defs.hpp"
 #include "board.hpp"
+#include "movie.hpp"
+#include "input.hpp"
+#include "pacer.hpp"
+#include "audio.hpp"
+#include "runahead.hpp"
+#include "bootcache.hpp"
 
-#include <chrono>
-#include <thread>
 
 //Screen dimension constants
 const int SCREEN_WIDTH = 160;
 const int SCREEN_HEIGHT = 144;
 
+struct RenderOptions {
+	std::string movieFilepath;	// Records the session when set
+	bool vsync = false;			// Present in lockstep with the display refresh
+	bool audio = true;
+	int sampleRate = 48000;
+	bool audioSync = false;		// Let the audio queue pace the emulation instead of the frame timer
+	int audioLatency = 64;		// Target audio latency in ms for audio sync
+	bool fifoPPU = false;		// Cycle accurate pixel FIFO instead of the scanline renderer
+	bool rtcHostTime = false;	// MBC3 clock follows the host clock instead of emulated time
+	int runAheadFrames = 0;		// Frames shown ahead of the emulation to hide the game's input lag
+	bool runAheadSecondInstance = false;	// Run ahead on a second board instead of forks
+	bool bootCache = false;		// Start from a cached snapshot taken at bootPoint
+	BootCache::Point bootPoint = BootCache::powerOn;
+	int bootFrames = 0;			// For BootCache::afterFrames
+};
+
 class Render {
 private:
 	static Uint32 pixels[];
@@ -21,17 +41,27 @@ private:
 
 public:
 	Board board;
+	RenderOptions options;
+	Input input;
+	Movie movie;
+	FramePacer pacer;
+	SDLAudioSink* audio = nullptr;
+	AudioSync* audioSync = nullptr;
+	RunAhead* runAhead = nullptr;
 	SDL_Window* window;
 	SDL_Renderer *renderer;
 	SDL_Texture *screenTexture;
 	SDL_Texture *vramTilesTexture;
 	SDL_Texture *backgorundTilesTexture;
+	bool screenTextureValid = false;
 
 	Render();
 	Render(std::string filepath);
+	Render(std::string filepath, RenderOptions options);
 	~Render();
 	void mainLoop();
 	void render(const byte[SCREEN_HEIGHT][SCREEN_WIDTH]);
+	void render(const LCD&);
 	void renderTiles(const byte[24 * 8][16 * 8]);
 	void renderBackground(const byte[32 * 8][32 * 8]);
 	bool init();
@@ -0,0 +1,153 @@
+#include "rollback.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+RollbackSession::RollbackSession(std::string romFilepath, int localPlayer, Transport* transport, int maxRollback)
+	: localPlayer(localPlayer), transport(transport), maxRollback(std::min(maxRollback, InputPacket::maxInputs / 2)), frame(0), remoteConfirmed(0),
+	  remoteAck(0), firstMispredicted(~0u), snapshots(this->maxRollback + 1), stats() {
+	for(int i = 0; i < 2; i++) boards[i] = new Board(romFilepath);
+	if(!isLoaded()) return;
+	boards[0]->connectSerialPeer(boards[1]);
+	startClock = boards[0]->memory->clockCounter;
+}
+
+RollbackSession::~RollbackSession() {
+	for(int i = 0; i < 2; i++) delete boards[i];
+}
+
+bool RollbackSession::isLoaded() { return boards[0]->memory != nullptr && boards[1]->memory != nullptr; }
+
+Board& RollbackSession::board(int player) { return *boards[player]; }
+Board& RollbackSession::localBoard() { return *boards[localPlayer]; }
+unsigned RollbackSession::getFrame() { return frame; }
+unsigned RollbackSession::getConfirmedFrame() { return std::min(frame, remoteConfirmed); }
+RollbackSession::Stats RollbackSession::getStats() { return stats; }
+
+bool RollbackSession::advanceFrame(byte localInput) {
+	receiveInputs();
+	rollback();
+	if(frame >= remoteConfirmed + maxRollback) {
+		stats.stalls++;
+		sendInputs();
+		return false;
+	}
+
+	reserveFrame(frame);
+	inputs[localPlayer][frame] = localInput;
+	if(!remoteReceived[frame]) inputs[1 - localPlayer][frame] = predictRemote();
+	saveSnapshot(frame);
+	emulateFrame(frame, true);
+	frame++;
+	stats.frames++;
+	sendInputs();
+	return true;
+}
+
+void RollbackSession::poll() {
+	receiveInputs();
+	rollback();
+	sendInputs();
+}
+
+void RollbackSession::reserveFrame(unsigned frame) {
+	if(remoteReceived.size() > frame) return;
+	for(int i = 0; i < 2; i++) inputs[i].resize(frame + 1, 0xFF);
+	remoteReceived.resize(frame + 1, false);
+}
+
+// The last input that is sure, or no keys before the first one
+byte RollbackSession::predictRemote() { return remoteConfirmed > 0 ? inputs[1 - localPlayer][remoteConfirmed - 1] : 0xFF; }
+
+void RollbackSession::receiveInputs() {
+	int remote = 1 - localPlayer;
+	InputPacket packet;
+	while(transport->receive(packet)) {
+		remoteAck = std::max(remoteAck, std::min(packet.ackFrame, frame));
+		for(int i = 0; i < packet.count && i < InputPacket::maxInputs; i++) {
+			unsigned inputFrame = packet.firstFrame + i;
+			if(inputFrame < remoteConfirmed || inputFrame > frame + 1024) continue;
+			reserveFrame(inputFrame);
+			if(remoteReceived[inputFrame]) continue;
+
+			if(inputFrame < frame && inputs[remote][inputFrame] != packet.inputs[i])
+				firstMispredicted = std::min(firstMispredicted, inputFrame);
+			inputs[remote][inputFrame] = packet.inputs[i];
+			remoteReceived[inputFrame] = true;
+		}
+		while(remoteConfirmed < remoteReceived.size() && remoteReceived[remoteConfirmed]) remoteConfirmed++;
+	}
+}
+
+// Everything the remote player hasn't acknowledged yet, oldest first
+void RollbackSession::sendInputs() {
+	InputPacket packet;
+	packet.firstFrame = std::max(remoteAck, frame > (unsigned) InputPacket::maxInputs ? frame - InputPacket::maxInputs : 0);
+	packet.ackFrame = remoteConfirmed;
+	packet.count = 0;
+	for(unsigned f = packet.firstFrame; f < frame; f++) packet.inputs[packet.count++] = inputs[localPlayer][f];
+	transport->send(packet);
+}
+
+// Frames after the wrong one are predicted again from the newest sure input on the way
+void RollbackSession::rollback() {
+	if(firstMispredicted >= frame) {
+		firstMispredicted = ~0u;
+		return;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int remote = 1 - localPlayer;
+
+	// The lines shown stay the reference for the dirty lines of the next frame drawn
+	uint64_t shownLineHashes[2][0x90];
+	for(int i = 0; i < 2; i++) memcpy(shownLineHashes[i], boards[i]->lcd.lineHashes, sizeof(shownLineHashes[i]));
+
+	loadSnapshot(firstMispredicted);
+	for(unsigned f = firstMispredicted; f < frame; f++) {
+		if(!remoteReceived[f]) inputs[remote][f] = predictRemote();
+		if(f != firstMispredicted) saveSnapshot(f);
+		emulateFrame(f, false);
+	}
+	for(int i = 0; i < 2; i++) memcpy(boards[i]->lcd.lineHashes, shownLineHashes[i], sizeof(shownLineHashes[i]));
+
+	stats.rollbacks++;
+	stats.resimulatedFrames += frame - firstMispredicted;
+	stats.resimulationSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	firstMispredicted = ~0u;
+}
+
+void RollbackSession::saveSnapshot(unsigned frame) {
+	std::stringstream& snapshot = snapshots[frame % snapshots.size()];
+	snapshot.seekp(0);
+	boards[0]->saveState(snapshot);
+	boards[1]->saveState(snapshot);
+}
+
+void RollbackSession::loadSnapshot(unsigned frame) {
+	std::stringstream& snapshot = snapshots[frame % snapshots.size()];
+	snapshot.seekg(0);
+	boards[0]->loadState(snapshot);
+	boards[1]->loadState(snapshot);
+}
+
+// Frames are a fixed number of clocks, so both boards end every frame at the same clock
+// whether their LCD is on or not. The board behind always runs next.
+void RollbackSession::emulateFrame(unsigned frame, bool render) {
+	unsigned long long end = startClock + (unsigned long long) (frame + 1) * Board::clocksPerFrame;
+	for(int i = 0; i < 2; i++) {
+		boards[i]->memory->setJoypadKeystates(inputs[i][frame]);
+		boards[i]->lcd.renderingEnabled = render;
+	}
+
+	Board* first = boards[0];
+	Board* second = boards[1];
+	while(true) {
+		Board* behind = first->memory->clockCounter <= second->memory->clockCounter ? first : second;
+		if(behind->memory->clockCounter >= end) break;
+		behind->step();
+	}
+
+	for(int i = 0; i < 2; i++) boards[i]->lcd.renderingEnabled = true;
+}
@@ -0,0 +1,76 @@
+#ifndef ROLLBACK_HPP
+#define ROLLBACK_HPP
+
+#include "defs.hpp"
+#include "board.hpp"
+#include "transport.hpp"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Link cable play over a network with rollback. Each player runs both Game Boys, stepped
+// on one thread interleaved by master clock and linked with Board::connectSerialPeer, so
+// both players emulate exactly the same thing. Every frame the local input goes to the
+// other player and the remote input is predicted to stay what it last was. When the real
+// input turns out different, both boards go back to the snapshot before that frame and the
+// frames since are emulated again in a burst without drawing.
+class RollbackSession {
+public:
+	struct Stats {
+		unsigned long long frames;				// Advanced
+		unsigned long long stalls;				// Calls that had to wait for the remote player
+		unsigned long long rollbacks;
+		unsigned long long resimulatedFrames;
+		double resimulationSeconds;
+	};
+private:
+	Board* boards[2];
+	int localPlayer;
+	Transport* transport;
+	int maxRollback;
+	unsigned long long startClock;
+
+	unsigned frame;					// Next frame to emulate
+	std::vector<byte> inputs[2];	// Keystates per frame, the remote ones predicted until they arrive
+	std::vector<bool> remoteReceived;
+	unsigned remoteConfirmed;		// Every remote input before this frame arrived
+	unsigned remoteAck;				// The remote player has our inputs before this frame
+	unsigned firstMispredicted;		// Earliest frame emulated with a wrong prediction
+
+	std::vector<std::stringstream> snapshots;	// Both boards before frame f in slot f % size
+
+	Stats stats;
+
+	void receiveInputs();
+	void sendInputs();
+	void rollback();
+	void reserveFrame(unsigned frame);
+	byte predictRemote();
+	void saveSnapshot(unsigned frame);
+	void loadSnapshot(unsigned frame);
+	void emulateFrame(unsigned frame, bool render);
+public:
+	// localPlayer is 0 or 1, player 0 is the first board. The ROM is the same for both.
+	// maxRollback is at most half of InputPacket::maxInputs, so resent inputs always reach back far enough.
+	RollbackSession(std::string romFilepath, int localPlayer, Transport* transport, int maxRollback = 8);
+	RollbackSession(const RollbackSession&) = delete;
+	~RollbackSession();
+
+	bool isLoaded();
+
+	// Emulates the next frame with the local input. Returns false without emulating if the
+	// frame would take the oldest unconfirmed remote input out of the rollback window.
+	bool advanceFrame(byte localInput);
+
+	// Takes in what arrived, rolls back if needed and sends the local inputs again
+	void poll();
+
+	Board& board(int player);
+	Board& localBoard();
+	unsigned getFrame();
+	unsigned getConfirmedFrame();	// Inputs of both players are known before this frame
+	Stats getStats();
+};
+
+#endif
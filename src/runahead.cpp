@@ -0,0 +1,49 @@
+#include "runahead.hpp"
+
+#include <chrono>
+#include <cstring>
+
+RunAhead::RunAhead(int frames, Mode mode) : frames(frames), mode(mode), drawBoard(false), ahead(nullptr), overheadSeconds(0), hostFrames(0) {
+	for(int i = 0; i < 0x90; i++) shownLineHashes[i] = 0;
+}
+
+RunAhead::~RunAhead() {
+	delete ahead;
+}
+
+const LCD& RunAhead::runFrame(Board& board) {
+	board.lcd.renderingEnabled = frames <= 0 || drawBoard;
+	board.runFrame();
+	board.lcd.renderingEnabled = true;
+	if(frames <= 0) return board.lcd;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if(mode == fork) {
+		delete ahead;
+		ahead = board.fork();
+	} else {
+		if(ahead == nullptr) ahead = board.fork();
+		state.seekp(0);
+		board.saveState(state);
+		state.seekg(0);
+		ahead->loadState(state);
+	}
+
+	// Only the last frame is drawn, against the lines shown the frame before
+	ahead->lcd.renderingEnabled = false;
+	for(int i = 1; i < frames; i++) ahead->runFrame();
+	ahead->lcd.renderingEnabled = true;
+	memcpy(ahead->lcd.lineHashes, shownLineHashes, sizeof(shownLineHashes));
+	ahead->runFrame();
+	memcpy(shownLineHashes, ahead->lcd.lineHashes, sizeof(shownLineHashes));
+
+	overheadSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	hostFrames++;
+	return ahead->lcd;
+}
+
+void RunAhead::setDrawBoard(bool draw) { drawBoard = draw; }
+
+int RunAhead::getFrames() { return frames; }
+
+double RunAhead::overheadMsPerFrame() { return hostFrames == 0 ? 0 : overheadSeconds * 1000 / hostFrames; }
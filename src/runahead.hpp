@@ -0,0 +1,44 @@
+#ifndef RUNAHEAD_HPP
+#define RUNAHEAD_HPP
+
+#include "defs.hpp"
+#include "board.hpp"
+
+#include <cstdint>
+#include <sstream>
+
+// Hides the input lag games have of their own. Every host frame the board runs a frame
+// without drawing, then a copy of it runs frames more with the same input and the last of
+// those is shown. The board itself never sees the extra frames, so its audio and save file
+// go on as without run-ahead. Its own frames aren't drawn or hashed unless setDrawBoard is
+// on, which a movie being recorded needs for its frame hashes.
+//   fork            the copy is a fresh copy-on-write fork every frame
+//   secondInstance  one second board that loads the state of the board every frame
+class RunAhead {
+public:
+	enum Mode { fork, secondInstance };
+private:
+	int frames;
+	Mode mode;
+	bool drawBoard;
+	Board* ahead;				// Copy shown last, kept until the next frame
+	std::stringstream state;	// Reused for the second instance
+	uint64_t shownLineHashes[0x90];	// Lines of the frame shown before, for the dirty lines
+
+	double overheadSeconds;		// Time spent on the copy
+	long long hostFrames;
+public:
+	RunAhead(int frames, Mode mode = fork);
+	RunAhead(const RunAhead&) = delete;
+	~RunAhead();
+
+	// Runs the board one frame and returns the LCD holding the frame to show
+	const LCD& runFrame(Board& board);
+
+	void setDrawBoard(bool);
+
+	int getFrames();
+	double overheadMsPerFrame();	// What run-ahead added to a frame on average
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "savefile.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+SaveFile::SaveFile(std::string filepath, size_t size)
+	: filepath(filepath), size(size), data(nullptr), existingSize(0), dirtyPages((size / pageSize + 63) / 64, 0),
+	  anyDirty(false), syncStart(size), syncEnd(0), nextFlush(std::chrono::steady_clock::now()) {
+	data = new byte[size]();
+	file.open(filepath, std::ios::in | std::ios::out | std::ios::binary);
+	if(file.is_open()) {
+		file.seekg(0, std::ios_base::end);
+		existingSize = (size_t) file.tellg();
+		file.seekg(0, std::ios_base::beg);
+		file.read((char*) data, existingSize < size ? existingSize : size);
+		file.clear();
+	} else {
+		file.open(filepath, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+		if(!file.is_open()) throw std::runtime_error("Can't open save file " + filepath);
+	}
+}
+
+SaveFile::~SaveFile() {
+	delete[] data;
+}
+
+void SaveFile::sync(bool wait) {
+	if(syncStart >= syncEnd) return;
+	file.seekp(syncStart);
+	file.write((const char*) data + syncStart, syncEnd - syncStart);
+	file.flush();
+	syncStart = size;
+	syncEnd = 0;
+}
+
+#else
+
+SaveFile::SaveFile(std::string filepath, size_t size)
+	: filepath(filepath), size(size), data(nullptr), existingSize(0), dirtyPages((size / pageSize + 63) / 64, 0),
+	  anyDirty(false), syncStart(size), syncEnd(0), nextFlush(std::chrono::steady_clock::now()) {
+	fd = open(filepath.c_str(), O_RDWR | O_CREAT, 0644);
+	if(fd < 0) throw std::runtime_error("Can't open save file " + filepath);
+
+	struct stat info;
+	if(fstat(fd, &info) == 0) existingSize = info.st_size;
+	if(existingSize < size && ftruncate(fd, size) != 0) {
+		close(fd);
+		throw std::runtime_error("Can't resize save file " + filepath);
+	}
+
+	void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mapping == MAP_FAILED) {
+		close(fd);
+		throw std::runtime_error("Can't map save file " + filepath);
+	}
+	data = (byte*) mapping;
+}
+
+SaveFile::~SaveFile() {
+	munmap(data, size);
+	close(fd);
+}
+
+// msync wants the start on a host page boundary
+void SaveFile::sync(bool wait) {
+	if(syncStart >= syncEnd) return;
+	size_t hostPage = sysconf(_SC_PAGESIZE);
+	size_t start = syncStart / hostPage * hostPage;
+	msync(data + start, syncEnd - start, wait ? MS_SYNC : MS_ASYNC);
+	syncStart = size;
+	syncEnd = 0;
+}
+
+#endif
+
+bool SaveFile::hasContents(size_t count) { return existingSize >= count; }
+const byte* SaveFile::contents() { return data; }
+
+void SaveFile::markAllDirty() {
+	for(uint64_t& bits : dirtyPages) bits = ~0ULL;
+	anyDirty = true;
+}
+
+void SaveFile::clearDirty() {
+	for(uint64_t& bits : dirtyPages) bits = 0;
+	anyDirty = false;
+}
+
+bool SaveFile::isFlushDue() {
+	if(!anyDirty) return false;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if(now < nextFlush) return false;
+	nextFlush = now + std::chrono::milliseconds(flushIntervalMs);
+	return true;
+}
+
+void SaveFile::write(size_t offset, const byte* source, size_t count) {
+	if(offset + count > size) return;
+	memcpy(data + offset, source, count);
+	if(offset < syncStart) syncStart = offset;
+	if(offset + count > syncEnd) syncEnd = offset + count;
+}
+
+void SaveFile::flush(const CowPages& ram, bool wait) {
+	if(anyDirty) {
+		for(int page = 0; page < ram.pageCount(); page++) {
+			uint64_t& bits = dirtyPages[page / 64];
+			uint64_t bit = 1ULL << (page % 64);
+			if((bits & bit) == 0) continue;
+			bits &= ~bit;
+			write((size_t) page * pageSize, ram.readPage(page), pageSize);
+		}
+		anyDirty = false;
+	}
+	sync(wait);
+}
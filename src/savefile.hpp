@@ -0,0 +1,67 @@
+#ifndef SAVEFILE_HPP
+#define SAVEFILE_HPP
+
+#include "defs.hpp"
+#include "cow.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Battery backed cartridge RAM kept in a .sav file that is mapped into memory. Writes to
+// the cartridge RAM only mark their 256 byte page dirty. At most once per flush interval
+// the dirty pages are copied into the mapping and handed to the kernel to write back, so
+// the emulation never waits for the disk and only touched pages are written.
+class SaveFile {
+private:
+	std::string filepath;
+	size_t size;
+	byte* data;				// The mapped file
+	size_t existingSize;	// Size of the file before it was opened
+#ifdef _WIN32
+	std::fstream file;		// No mmap here; data is a copy and writes go through the stream
+#else
+	int fd;
+#endif
+
+	std::vector<uint64_t> dirtyPages;	// Bit per page of the cartridge RAM
+	bool anyDirty;
+	size_t syncStart;		// Range written since the last sync
+	size_t syncEnd;
+	std::chrono::steady_clock::time_point nextFlush;
+
+	void sync(bool wait);
+public:
+	static const int pageSize = 0x100;
+	static const int flushIntervalMs = 1000;
+
+	// Creates the file if needed, throws std::runtime_error if it can't be opened or mapped
+	SaveFile(std::string filepath, size_t size);
+	SaveFile(const SaveFile&) = delete;
+	~SaveFile();
+
+	// Whether the file already held count bytes when it was opened
+	bool hasContents(size_t count);
+	const byte* contents();
+
+	void markDirty(size_t offset) {
+		dirtyPages[offset / pageSize / 64] |= 1ULL << (offset / pageSize % 64);
+		anyDirty = true;
+	}
+	void markAllDirty();
+	void clearDirty();
+
+	// Something is dirty and the last flush is at least the flush interval ago
+	bool isFlushDue();
+
+	// Writes bytes after the cartridge RAM (the clock of MBC3 carts)
+	void write(size_t offset, const byte* source, size_t count);
+
+	// Copies the dirty pages of the RAM into the file and hands everything written to the
+	// kernel, with wait it returns once it is on disk
+	void flush(const CowPages& ram, bool wait);
+};
+
+#endif
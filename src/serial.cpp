@@ -0,0 +1,199 @@
+#include "serial.hpp"
+#include "state.hpp"
+
+#include <chrono>
+#include <thread>
+
+SerialLink::SerialLink() {
+	for(int i = 0; i < 2; i++) {
+		attached[i] = false;
+		clocks[i].value = 0;
+		ports[i].link = this;
+		ports[i].side = i;
+	}
+}
+
+SerialPort* SerialLink::port(int side) { return &ports[side]; }
+
+bool SerialPort::send(const SerialMessage& message) { return link->rings[side].push(message); }
+bool SerialPort::receive(SerialMessage& message) { return link->rings[1 - side].pop(message); }
+void SerialPort::attach(bool attached) { link->attached[side].store(attached, std::memory_order_release); }
+bool SerialPort::isPeerAttached() { return link->attached[1 - side].load(std::memory_order_acquire); }
+void SerialPort::publishClock(unsigned long long clock) { link->clocks[side].value.store(clock, std::memory_order_release); }
+unsigned long long SerialPort::peerClock() { return link->clocks[1 - side].value.load(std::memory_order_acquire); }
+
+Serial::Serial()
+	: nextEvent(~0ULL), sbReg(0), scReg(0), transferEnd(0), transferId(0), hasIncoming(false), awaitingReply(false), hasReply(false), reply(0xFF), stalledPeerClock(~0ULL),
+	  clock(nullptr), interrupts(nullptr), port(nullptr), peer(nullptr), capture(nullptr) {}
+
+Serial::Serial(const Serial& other) : Serial() {
+	nextEvent = other.nextEvent;
+	sbReg = other.sbReg;
+	scReg = other.scReg;
+	transferEnd = other.transferEnd;
+	transferId = other.transferId;
+}
+
+void Serial::connectClock(const unsigned long long* masterClock) { clock = masterClock; }
+void Serial::connectInterrupts(InterruptController* controller) { interrupts = controller; }
+
+void Serial::connectLink(SerialPort* link) {
+	if(port != nullptr) port->attach(false);
+	port = link;
+	if(port != nullptr) {
+		port->publishClock(*clock);
+		port->attach(true);
+	}
+	hasIncoming = false;
+	awaitingReply = false;
+	hasReply = false;
+	stalledPeerClock = ~0ULL;
+	schedule();
+}
+
+void Serial::connectPeer(Serial* other) {
+	if(peer != nullptr && peer != other) peer->peer = nullptr;
+	peer = other;
+	if(peer != nullptr) peer->peer = this;
+}
+
+byte Serial::exchange(byte data) {
+	if((scReg & 0x81) != 0x80) return 0xFF;
+	byte out = sbReg;
+	finishTransfer(data);
+	schedule();
+	return out;
+}
+
+void Serial::setCapture(std::string* output) { capture = output; }
+
+byte Serial::getByte(word addr) {
+	if(addr == 0xFF01) return sbReg;
+	return scReg | 0x7E;
+}
+
+void Serial::setByte(word addr, byte data) {
+	if(addr == 0xFF01) {
+		sbReg = data;
+		return;
+	}
+
+	scReg = data & 0x81;
+	if((scReg & 0x81) == 0x81) {	// Start with the internal clock
+		transferEnd = *clock + transferClocks;
+		transferId++;
+		hasReply = false;
+		if(capture != nullptr) capture->push_back((char) sbReg);
+		awaitingReply = port != nullptr && port->isPeerAttached() && port->send({ transferEnd, transferId, SerialMessage::transfer, sbReg });
+	}
+	schedule();
+}
+
+// Earliest of the end of our transfer, the other side's transfer and the next poll
+void Serial::schedule() {
+	nextEvent = ~0ULL;
+	if((scReg & 0x81) == 0x81) nextEvent = transferEnd;
+	if(hasIncoming && incoming.clock < nextEvent) nextEvent = incoming.clock;
+	if(port != nullptr && clock != nullptr && *clock + pollClocks < nextEvent) nextEvent = *clock + pollClocks;
+}
+
+void Serial::update() {
+	if(port != nullptr) poll();
+	if((scReg & 0x81) == 0x81 && *clock >= transferEnd) {
+		byte received = 0xFF;
+		if(peer != nullptr) received = peer->exchange(sbReg);
+		else if(awaitingReply) received = waitForReply();
+		awaitingReply = false;
+		finishTransfer(received);
+	}
+	schedule();
+}
+
+// A side waiting for the external clock that got too far ahead waits here for the other
+// side, so the other side's transfer reaches it before it is due
+void Serial::poll() {
+	port->publishClock(*clock);
+	receive();
+
+	if((scReg & 0x81) == 0x80 && !hasIncoming && *clock > port->peerClock() + maxLead && port->peerClock() != stalledPeerClock) {
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(replyTimeoutMs);
+		while(!hasIncoming && *clock > port->peerClock() + maxLead && port->isPeerAttached()) {
+			if(std::chrono::steady_clock::now() >= deadline) {
+				stalledPeerClock = port->peerClock();	// Not running, don't wait for it again
+				break;
+			}
+			std::this_thread::yield();
+			receive();
+		}
+	}
+	answerIfDue();
+}
+
+// Keeps the transfer of the other side and the reply to ours for later. Replies nobody
+// waits for any more are dropped.
+void Serial::receive() {
+	SerialMessage message;
+	while(port->receive(message)) {
+		if(message.type == SerialMessage::transfer) {
+			incoming = message;
+			hasIncoming = true;
+		} else if(awaitingReply && message.id == transferId) {
+			reply = message.data;
+			hasReply = true;
+		}
+	}
+}
+
+// Only a side waiting for the external clock takes part, anything else shifts out 0xFF
+void Serial::answerIfDue() {
+	if(!hasIncoming || *clock < incoming.clock) return;
+	hasIncoming = false;
+
+	byte data = 0xFF;
+	if((scReg & 0x81) == 0x80) {
+		data = sbReg;
+		finishTransfer(incoming.data);
+	}
+	port->send({ *clock, incoming.id, SerialMessage::reply, data });
+}
+
+void Serial::finishTransfer(byte received) {
+	sbReg = received;
+	scReg &= ~0x80;
+	interrupts->request(InterruptController::serial);
+}
+
+// Answers the other side meanwhile, it may be waiting for us just the same
+byte Serial::waitForReply() {
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(replyTimeoutMs);
+	port->publishClock(*clock);
+	while(port->isPeerAttached()) {
+		receive();
+		if(hasReply) return reply;
+		answerIfDue();
+		if(std::chrono::steady_clock::now() >= deadline) {
+			std::cerr << "Serial link: no reply from the other side" << std::endl;
+			break;
+		}
+		std::this_thread::yield();
+	}
+	return 0xFF;
+}
+
+void Serial::saveState(std::ostream& out) {
+	writeState(out, sbReg);
+	writeState(out, scReg);
+	writeState(out, transferEnd);
+	writeState(out, transferId);
+}
+
+void Serial::loadState(std::istream& in) {
+	readState(in, sbReg);
+	readState(in, scReg);
+	readState(in, transferEnd);
+	readState(in, transferId);
+	hasIncoming = false;
+	awaitingReply = false;
+	hasReply = false;
+	schedule();
+}
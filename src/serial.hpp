@@ -0,0 +1,129 @@
+#ifndef SERIAL_HPP
+#define SERIAL_HPP
+
+#include "defs.hpp"
+#include "interrupts.hpp"
+#include "spscring.hpp"
+
+#include <atomic>
+#include <iostream>
+#include <string>
+
+// What one side of a link cable tells the other. A transfer carries the byte of the side
+// with the internal clock and the master clock its transfer ends at, the reply the byte
+// the other side shifted out.
+struct SerialMessage {
+	enum Type : byte { transfer, reply };
+
+	unsigned long long clock;
+	unsigned id;
+	Type type;
+	byte data;
+};
+
+class SerialLink;
+
+// One end of a SerialLink, used by the thread running its board
+class SerialPort {
+private:
+	SerialLink* link = nullptr;
+	int side = 0;
+
+	friend class SerialLink;
+public:
+	bool send(const SerialMessage&);
+	bool receive(SerialMessage&);
+	void attach(bool);
+	bool isPeerAttached();
+
+	// Master clock of each side, published every few hundred clocks
+	void publishClock(unsigned long long);
+	unsigned long long peerClock();
+};
+
+// Link cable between two boards in the same process, each running on its own thread.
+// Messages go through a lock-free ring per direction, stamped with the master clock of
+// the sender. The boards run freely and only wait for each other while a transfer is in
+// flight: the side with the internal clock at its end for the byte of the other side, a
+// side waiting for the external clock when it gets too far ahead of the other side.
+class SerialLink {
+private:
+	SpscRing<SerialMessage, 16> rings[2];	// Ring i carries what side i sends
+	struct alignas(64) Clock { std::atomic<unsigned long long> value; };
+	Clock clocks[2];
+	std::atomic<bool> attached[2];
+	SerialPort ports[2];
+
+	friend class SerialPort;
+public:
+	SerialLink();
+	SerialLink(const SerialLink&) = delete;
+
+	SerialPort* port(int side);
+};
+
+// SB (0xFF01) and SC (0xFF02). A transfer started with the internal clock shifts 8 bits
+// at 8192 Hz and ends transferClocks later. Without a link the other side reads as 0xFF,
+// like with no cable plugged in; a side waiting for the external clock waits until the
+// other side starts a transfer.
+class Serial {
+public:
+	unsigned long long nextEvent;	// Board::step calls update once the master clock gets here
+private:
+	byte sbReg;
+	byte scReg;
+	unsigned long long transferEnd;		// Master clock the transfer with the internal clock ends at
+	unsigned transferId;
+
+	SerialMessage incoming;		// Transfer of the other side, answered when our clock gets to it
+	bool hasIncoming;
+	bool awaitingReply;			// Our transfer went out over the link
+	bool hasReply;				// and this came back
+	byte reply;
+	unsigned long long stalledPeerClock;	// Peer didn't move from here last time we waited for it
+
+	const unsigned long long* clock;
+	InterruptController* interrupts;
+	SerialPort* port;
+	Serial* peer;		// Other end of a cable to a board stepped on the same thread
+	std::string* capture;
+
+	void poll();
+	void receive();
+	void answerIfDue();
+	void finishTransfer(byte received);
+	byte waitForReply();
+	void schedule();
+public:
+	static const int transferClocks = 4096;
+	static const int pollClocks = 512;		// How often a linked port looks for messages
+	static const int maxLead = 2048;		// Clocks a side waiting for the external clock may run ahead
+	static const int replyTimeoutMs = 1000;	// A peer that doesn't answer counts as unplugged
+
+	Serial();
+	Serial(const Serial&);	// Registers only, the cable stays with the original
+
+	void update();
+
+	byte getByte(word);
+	void setByte(word, byte);
+
+	void connectClock(const unsigned long long*);
+	void connectInterrupts(InterruptController*);
+	void connectLink(SerialPort*);	// nullptr unplugs the cable
+
+	// Cable to a board stepped on the same thread, interleaved by master clock. The transfer
+	// is exchanged with the other side directly when it ends, with no waiting or messages.
+	// Plugs both ends, nullptr unplugs both.
+	void connectPeer(Serial*);
+	byte exchange(byte data);		// Called by the peer, returns what this side shifts out
+
+	// Appends every byte sent with the internal clock, which is how test ROMs print.
+	// nullptr stops capturing.
+	void setCapture(std::string*);
+
+	void saveState(std::ostream&);
+	void loadState(std::istream&);
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef SPSCRING_HPP
+#define SPSCRING_HPP
+
+#include <atomic>
+
+// Fixed size queue for exactly one producer thread and one consumer thread, without locks.
+// capacity has to be a power of two. The indices only grow, the producer owns head and
+// the consumer tail, each on its own cache line.
+template<typename T, unsigned capacity> class SpscRing {
+private:
+	static_assert((capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+
+	alignas(64) std::atomic<unsigned> head;
+	alignas(64) std::atomic<unsigned> tail;
+	alignas(64) T items[capacity];
+public:
+	SpscRing() : head(0), tail(0) {}
+	SpscRing(const SpscRing&) = delete;
+
+	// Returns false if the ring is full
+	bool push(const T& item) {
+		unsigned h = head.load(std::memory_order_relaxed);
+		if(h - tail.load(std::memory_order_acquire) == capacity) return false;
+		items[h & (capacity - 1)] = item;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if the ring is empty
+	bool pop(T& item) {
+		unsigned t = tail.load(std::memory_order_relaxed);
+		if(head.load(std::memory_order_acquire) == t) return false;
+		item = items[t & (capacity - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef STATE_HPP
+#define STATE_HPP
+
+#include <iostream>
+
+// Raw binary (de)serialization of plain values and arrays for save states
+template<typename T>
+inline void writeState(std::ostream& out, const T& value) {
+	out.write((const char*) &value, sizeof(T));
+}
+
+template<typename T>
+inline void readState(std::istream& in, T& value) {
+	in.read((char*) &value, sizeof(T));
+}
+
+#endif
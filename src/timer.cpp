@@ -1,7 +1,8 @@
 #include "timer.hpp"
+#include "state.hpp"
 #include <iostream>
 
-Timer::Timer() : divReg(0xABCC), timaReg(0), tmaReg(0), tacReg(0), interruptRequested(false) {}
+Timer::Timer() : divReg(0xABCC), timaReg(0), tmaReg(0), tacReg(0), interrupts(nullptr) {}
 
 Timer::~Timer() {}
 
@@ -24,7 +25,7 @@ void Timer::run(int clocks) {
 		if(oldRelaventDivBit == 1 && newRelaventDivBit == 0 && (tacReg & 0x4) != 0) {	
 			timaReg++;
 			if(timaReg < oldTima) {	// Interrupt triggered
-				interruptRequested = true;
+				interrupts->request(InterruptController::timer);
 				timaReg = tmaReg;
 			}
 		}
@@ -101,5 +102,19 @@ byte Timer::readByte(word addr) {
 	}
 }
 
-bool Timer::isInterruptRequested() { return interruptRequested; }
-void Timer::setInterruptRequested(bool data) { interruptRequested = data; }
+void Timer::connectInterrupts(InterruptController* controller) { interrupts = controller; }
+
+
+void Timer::saveState(std::ostream& out) {
+	writeState(out, divReg);
+	writeState(out, timaReg);
+	writeState(out, tmaReg);
+	writeState(out, tacReg);
+}
+
+void Timer::loadState(std::istream& in) {
+	readState(in, divReg);
+	readState(in, timaReg);
+	readState(in, tmaReg);
+	readState(in, tacReg);
+}
@@ -2,6 +2,8 @@
 #define TIMER_HPP
 
 #include "defs.hpp"
+#include "interrupts.hpp"
+#include <iostream>
 
 class Timer {
 private:
@@ -10,7 +12,7 @@ private:
 	byte tmaReg;	// Mapped to 0xFF06
 	byte tacReg;	// Mapped to 0xFF07
 
-	bool interruptRequested;
+	InterruptController* interrupts;
 public:
 	Timer();
 	~Timer();
@@ -22,8 +24,10 @@ public:
 	void writeByte(word, byte);
 	byte readByte(word);
 
-	bool isInterruptRequested();
-	void setInterruptRequested(bool);
+	void connectInterrupts(InterruptController*);
+
+	void saveState(std::ostream&);
+	void loadState(std::istream&);
 };
 
 #endif
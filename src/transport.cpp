@@ -0,0 +1,30 @@
+#include "transport.hpp"
+
+LoopbackLink::LoopbackLink(double delayMs, double jitterMs, double lossRate, unsigned seed)
+	: delayMs(delayMs), jitterMs(jitterMs), lossRate(lossRate), random(seed) {
+	for(int i = 0; i < 2; i++) {
+		ends[i].link = this;
+		ends[i].side = i;
+	}
+}
+
+Transport* LoopbackLink::transport(int side) { return &ends[side]; }
+
+void LoopbackTransport::send(const InputPacket& packet) {
+	std::lock_guard<std::mutex> lock(link->mutex);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	if(uniform(link->random) < link->lossRate) return;
+
+	double latency = link->delayMs + link->jitterMs * uniform(link->random);
+	LoopbackLink::Clock::time_point arrival = LoopbackLink::Clock::now() + std::chrono::microseconds((long long) (latency * 1000));
+	link->queues[1 - side].insert({ arrival, packet });
+}
+
+bool LoopbackTransport::receive(InputPacket& packet) {
+	std::lock_guard<std::mutex> lock(link->mutex);
+	std::multimap<LoopbackLink::Clock::time_point, InputPacket>& queue = link->queues[side];
+	if(queue.empty() || queue.begin()->first > LoopbackLink::Clock::now()) return false;
+	packet = queue.begin()->second;
+	queue.erase(queue.begin());
+	return true;
+}
@@ -0,0 +1,67 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include "defs.hpp"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+
+// Inputs of one player for a run of frames. Every packet repeats the frames the other
+// side hasn't acknowledged yet, so lost packets need no resending of their own.
+struct InputPacket {
+	static const int maxInputs = 32;
+
+	unsigned firstFrame;		// Frame of inputs[0]
+	unsigned ackFrame;			// Sender has every input of the receiver before this frame
+	byte count;
+	byte inputs[maxInputs];		// Joypad keystates
+};
+
+// How rollback sessions reach each other. Packets may be lost, late or reordered, like UDP.
+class Transport {
+public:
+	virtual ~Transport() {}
+	virtual void send(const InputPacket&) = 0;
+	virtual bool receive(InputPacket&) = 0;	// false when nothing arrived
+};
+
+class LoopbackLink;
+
+// One end of a LoopbackLink
+class LoopbackTransport : public Transport {
+private:
+	LoopbackLink* link = nullptr;
+	int side = 0;
+
+	friend class LoopbackLink;
+public:
+	void send(const InputPacket&);
+	bool receive(InputPacket&);
+};
+
+// Network in the process for trying rollback on one machine: a packet arrives delayMs
+// plus up to jitterMs later, so packets overtake each other, and lossRate of them never do.
+class LoopbackLink {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	std::mutex mutex;
+	std::multimap<Clock::time_point, InputPacket> queues[2];	// Queue i holds what side i receives
+	LoopbackTransport ends[2];
+
+	double delayMs;
+	double jitterMs;
+	double lossRate;
+	std::mt19937 random;
+
+	friend class LoopbackTransport;
+public:
+	LoopbackLink(double delayMs = 0, double jitterMs = 0, double lossRate = 0, unsigned seed = 1);
+	LoopbackLink(const LoopbackLink&) = delete;
+
+	Transport* transport(int side);
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "vecenv.hpp"
+#include "gbvecenv.h"
+
+#include <cassert>
+#include <new>
+#include <stdexcept>
+
+VecEnv::VecEnv(std::string romFilepath, int count, int downsample, bool packed, int stack, int threads, BootCache* bootCache)
+	: count(count), root(nullptr), boards(nullptr),
+	  generation(0), busyWorkers(0), stopping(false), nextEnv(0), stepActions(nullptr) {
+	if(count <= 0) throw std::invalid_argument("VecEnv needs at least one env");
+	observers.assign(count, Observer(downsample, packed, stack));
+
+	root = new Board(romFilepath);
+	if(root->memory == nullptr) {
+		delete root;
+		throw std::runtime_error("Can't load ROM " + romFilepath);
+	}
+	if(bootCache != nullptr) bootCache->restore(*root);
+
+	boards = static_cast<Board*>(::operator new(sizeof(Board) * count, std::align_val_t(alignof(Board))));
+	for(int i = 0; i < count; i++) {
+		new (&boards[i]) Board(root);
+		boards[i].unshare();
+		boards[i].lcd.setObserver(&observers[i]);
+	}
+
+	if(threads <= 0) threads = std::thread::hardware_concurrency();
+	if(threads > count) threads = count;
+	for(int i = 1; i < threads; i++) workers.emplace_back(&VecEnv::workerLoop, this);
+}
+
+VecEnv::~VecEnv() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	startCondition.notify_all();
+	for(std::thread& worker : workers) worker.join();
+
+	for(int i = 0; i < count; i++) boards[i].~Board();
+	::operator delete(boards, std::align_val_t(alignof(Board)));
+	delete root;
+}
+
+int VecEnv::size() { return count; }
+int VecEnv::observationWidth() { return observers[0].width(); }
+int VecEnv::observationHeight() { return observers[0].height(); }
+int VecEnv::observationSize() { return observers[0].observationSize(); }
+
+void VecEnv::setObservationRing(byte* ring, int slots) {
+	size_t slotStride = (size_t)count * observationSize();
+	for(int i = 0; i < count; i++) observers[i].setRing(ring + (size_t)i * observationSize(), slots, slotStride);
+}
+
+Board& VecEnv::getBoard(int env) { return boards[env]; }
+
+void VecEnv::reset(int env) {
+	boards[env].~Board();
+	new (&boards[env]) Board(root);
+	boards[env].unshare();
+	boards[env].lcd.setObserver(&observers[env]);
+	observers[env].restart(boards[env].lcd.screen);
+}
+
+int VecEnv::reset() {
+	for(int i = 0; i < count; i++) {
+		observers[i].rewind();
+		reset(i);
+	}
+	return 0;
+}
+
+int VecEnv::step(const byte* actions) {
+	stepActions = actions;
+	nextEnv.store(0, std::memory_order_relaxed);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		busyWorkers = workers.size();
+		generation++;
+	}
+	startCondition.notify_all();
+
+	runEnvs();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCondition.wait(lock, [this] { return busyWorkers == 0; });
+
+	// runFrame ends every frame through the LCD's completeFrame, so each env captured exactly once
+	for(int i = 1; i < count; i++) assert(observers[i].latestSlot() == observers[0].latestSlot());
+	return observers[0].latestSlot();
+}
+
+void VecEnv::workerLoop() {
+	unsigned long long seen = 0;
+	while(true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			startCondition.wait(lock, [&] { return stopping || generation != seen; });
+			if(stopping) return;
+			seen = generation;
+		}
+
+		runEnvs();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if(--busyWorkers == 0) doneCondition.notify_one();
+	}
+}
+
+// Every thread takes envs off the shared counter until none are left
+void VecEnv::runEnvs() {
+	while(true) {
+		int env = nextEnv.fetch_add(1, std::memory_order_relaxed);
+		if(env >= count) return;
+		stepEnv(env);
+	}
+}
+
+// The observer picks up the frame when it completes inside runFrame
+void VecEnv::stepEnv(int env) {
+	boards[env].memory->setJoypadKeystates(~stepActions[env]);
+	boards[env].runFrame();
+}
+
+// --------------------------------- C interface -------------------------------------------------
+
+extern "C" {
+
+gb_vecenv* gb_vecenv_create(const char* rom, int count, int downsample, int packed, int stack, int threads) {
+	try {
+		return reinterpret_cast<gb_vecenv*>(new VecEnv(rom, count, downsample, packed != 0, stack, threads));
+	} catch(const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return nullptr;
+	}
+}
+
+void gb_vecenv_destroy(gb_vecenv* env) {
+	delete reinterpret_cast<VecEnv*>(env);
+}
+
+int gb_vecenv_size(gb_vecenv* env) { return reinterpret_cast<VecEnv*>(env)->size(); }
+int gb_vecenv_observation_width(gb_vecenv* env) { return reinterpret_cast<VecEnv*>(env)->observationWidth(); }
+int gb_vecenv_observation_height(gb_vecenv* env) { return reinterpret_cast<VecEnv*>(env)->observationHeight(); }
+int gb_vecenv_observation_size(gb_vecenv* env) { return reinterpret_cast<VecEnv*>(env)->observationSize(); }
+
+void gb_vecenv_set_ring(gb_vecenv* env, unsigned char* ring, int slots) {
+	reinterpret_cast<VecEnv*>(env)->setObservationRing(ring, slots);
+}
+
+int gb_vecenv_reset(gb_vecenv* env) {
+	return reinterpret_cast<VecEnv*>(env)->reset();
+}
+
+void gb_vecenv_reset_one(gb_vecenv* env, int index) {
+	reinterpret_cast<VecEnv*>(env)->reset(index);
+}
+
+int gb_vecenv_step(gb_vecenv* env, const unsigned char* actions) {
+	return reinterpret_cast<VecEnv*>(env)->step(actions);
+}
+
+}
@@ -0,0 +1,75 @@
+#ifndef VECENV_HPP
+#define VECENV_HPP
+
+#include "defs.hpp"
+#include "board.hpp"
+#include "observation.hpp"
+#include "bootcache.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A batch of boards running the same ROM, stepped one frame at a time in lockstep for
+// training agents. The boards live side by side in one allocation and are forks of a
+// root board, so they share the ROM. Each env has an Observer writing its frames into a
+// ring the caller owns, slot by slot with all envs of a slot next to each other.
+// Nothing is allocated while stepping.
+class VecEnv {
+private:
+	int count;
+
+	Board* root;		// State every env starts from, power-on or the boot snapshot
+	Board* boards;		// count boards constructed in place
+	std::vector<Observer> observers;
+
+	// Worker threads, woken for every step; the calling thread works too
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable startCondition;
+	std::condition_variable doneCondition;
+	unsigned long long generation;
+	int busyWorkers;
+	bool stopping;
+
+	// Arguments of the step in progress
+	std::atomic<int> nextEnv;
+	const byte* stepActions;
+
+	void workerLoop();
+	void runEnvs();
+	void stepEnv(int env);
+public:
+	// Observations as described by Observer; threads = 0 uses one thread per hardware thread.
+	// With a boot cache the envs start from its snapshot instead of power-on.
+	VecEnv(std::string romFilepath, int count, int downsample = 2, bool packed = false, int stack = 1, int threads = 0,
+		BootCache* bootCache = nullptr);
+	VecEnv(const VecEnv&) = delete;
+	~VecEnv();
+
+	int size();
+	int observationWidth();
+	int observationHeight();
+	int observationSize();		// Bytes per env and slot
+
+	// ring holds slots * size() * observationSize() bytes
+	void setObservationRing(byte* ring, int slots);
+
+	// Back to the start state, returns the slot with the first observations (0)
+	int reset();
+
+	// Only this env, its observation replaces the one in the latest slot
+	void reset(int env);
+
+	// Runs every env one frame and returns the slot its observations went to. actions has a
+	// byte per env with the joypad keys pressed, from MSB to LSB: start, select, B, A, down,
+	// up, left, right.
+	int step(const byte* actions);
+
+	Board& getBoard(int env);
+};
+
+#endif
@@ -0,0 +1,28 @@
+#include "watchpoints.hpp"
+
+void Watchpoints::add(word address, int accesses) {
+	address = unecho(address);
+	remove(address);
+	for(int i = 0; i < 2; i++) {
+		if((accesses & (1 << i)) == 0) continue;
+		addresses[i][address / 64] |= 1ULL << (address % 64);
+		pageCounts[i][address >> 8]++;
+	}
+}
+
+void Watchpoints::remove(word address) {
+	address = unecho(address);
+	for(int i = 0; i < 2; i++) {
+		uint64_t bit = 1ULL << (address % 64);
+		if((addresses[i][address / 64] & bit) == 0) continue;
+		addresses[i][address / 64] &= ~bit;
+		pageCounts[i][address >> 8]--;
+	}
+}
+
+bool Watchpoints::isEmpty() {
+	for(int i = 0; i < 2; i++)
+		for(int page = 0; page < 0x100; page++)
+			if(pageCounts[i][page] != 0) return false;
+	return true;
+}
@@ -0,0 +1,50 @@
+#ifndef WATCHPOINTS_HPP
+#define WATCHPOINTS_HPP
+
+#include "defs.hpp"
+
+#include <cstdint>
+
+// Addresses watched for reads or writes. Memory leaves every page with a watched address
+// out of its page table, so only accesses to those pages take the slow path and get
+// checked here; the other pages keep their direct mapping and cost nothing. Echo RAM
+// (0xE000 - 0xFDFF) is the same bytes as 0xC000 - 0xDDFF, either address watches both.
+class Watchpoints {
+public:
+	enum Access { read = 1, write = 2 };
+
+	struct Hit {
+		word address;
+		byte value;			// Written, or read
+		Access access;
+	};
+private:
+	uint64_t addresses[2][0x10000 / 64] = {};	// Bit per address for reads and writes
+	int pageCounts[2][0x100] = {};				// Watched addresses per page
+
+	static word unecho(word address) { return address >= 0xE000 && address < 0xFE00 ? address - 0x2000 : address; }
+public:
+	bool triggered = false;		// Set by an access, cleared by whoever stops on it
+	Hit hit;
+
+	// accesses is read, write or both
+	void add(word address, int accesses);
+	void remove(word address);
+	bool isEmpty();
+
+	bool isPageWatched(int page, Access access) { return pageCounts[access - 1][unecho(page << 8) >> 8] != 0; }
+
+	bool isWatched(word address, Access access) {
+		address = unecho(address);
+		return (addresses[access - 1][address / 64] >> (address % 64) & 1) != 0;
+	}
+
+	void trigger(word address, byte value, Access access) {
+		triggered = true;
+		hit.address = address;
+		hit.value = value;
+		hit.access = access;
+	}
+};
+
+#endif